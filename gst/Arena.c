@@ -0,0 +1,201 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Per session storage for finished fragments. Fragments are bump
+ * allocated out of a few large slabs preallocated for the session; a
+ * slab goes back on the free list once every fragment in it has been
+ * released by all readers. What does not fit, because the slabs are all
+ * pinned by slow readers, falls back to the heap. Everything is given
+ * back at once when the last fragment of a closed arena goes.
+ */
+
+#include <gst/gst.h>
+
+#include <string.h>
+
+#include "Arena.h"
+
+#define ARENA_ALIGN     64
+
+typedef struct
+{
+  Arena *arena;
+  guint8 *data;
+  gsize used;
+  guint live;
+} Slab;
+
+typedef struct
+{
+  Arena *arena;
+  Slab *slab;       /* NULL for heap fallbacks */
+  gpointer data;
+  gsize size;
+} Chunk;
+
+struct Arena
+{
+  GMutex lock;
+  gint ref;
+  gsize slab_size;
+  guint max_slabs;
+  GPtrArray *slabs;
+  GQueue free_slabs;
+  Slab *current;
+
+  guint64 live;
+  guint64 peak;
+};
+
+static void
+arena_unref (Arena *a)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&a->ref))
+    return;
+
+  for (i = 0; i < a->slabs->len; i++) {
+    Slab *s = g_ptr_array_index (a->slabs, i);
+
+    g_free (s->data);
+    g_slice_free (Slab, s);
+  }
+  g_ptr_array_free (a->slabs, TRUE);
+  g_queue_clear (&a->free_slabs);
+  g_mutex_clear (&a->lock);
+  g_slice_free (Arena, a);
+}
+
+static Slab*
+slab_new (Arena *a)
+{
+  Slab *s = g_slice_new0 (Slab);
+
+  s->arena = a;
+  s->data = g_malloc (a->slab_size);
+  g_ptr_array_add (a->slabs, s);
+
+  return s;
+}
+
+Arena*
+arena_new (gsize slab_size, guint prealloc, guint max_slabs)
+{
+  Arena *a = g_slice_new0 (Arena);
+  guint i;
+
+  g_mutex_init (&a->lock);
+  a->ref = 1;
+  a->slab_size = slab_size;
+  a->max_slabs = MAX (prealloc, max_slabs);
+  a->slabs = g_ptr_array_new ();
+  g_queue_init (&a->free_slabs);
+
+  for (i = 0; i < prealloc; i++)
+    g_queue_push_tail (&a->free_slabs, slab_new (a));
+
+  return a;
+}
+
+/* called with the lock held */
+static Slab*
+arena_next_slab (Arena *a)
+{
+  Slab *s = g_queue_pop_head (&a->free_slabs);
+
+  if (!s && a->slabs->len < a->max_slabs)
+    s = slab_new (a);
+  if (s)
+    s->used = 0;
+
+  return s;
+}
+
+static void
+chunk_release (gpointer data)
+{
+  Chunk *c = data;
+  Arena *a = c->arena;
+  Slab *s = c->slab;
+
+  g_mutex_lock (&a->lock);
+  a->live -= c->size;
+  if (!s) {
+    g_free (c->data);
+  } else if (--s->live == 0 && s != a->current) {
+    g_queue_push_tail (&a->free_slabs, s);
+  }
+  g_mutex_unlock (&a->lock);
+
+  g_slice_free (Chunk, c);
+  arena_unref (a);
+}
+
+/* A copy of buf whose memory lives in the arena */
+GstBuffer*
+arena_copy (Arena *a, GstBuffer *buf)
+{
+  gsize size = gst_buffer_get_size (buf);
+  gsize need = (size + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1);
+  Chunk *c = g_slice_new0 (Chunk);
+  GstBuffer *out;
+
+  c->arena = a;
+  c->size = size;
+
+  g_mutex_lock (&a->lock);
+  if (need <= a->slab_size) {
+    if (!a->current || a->current->used + need > a->slab_size) {
+      /* a retired slab nobody reads from any more is free right away */
+      if (a->current && a->current->live == 0)
+        g_queue_push_tail (&a->free_slabs, a->current);
+      a->current = arena_next_slab (a);
+    }
+    if (a->current) {
+      c->slab = a->current;
+      c->data = a->current->data + a->current->used;
+      a->current->used += need;
+      a->current->live++;
+    }
+  }
+  a->live += size;
+  a->peak = MAX (a->peak, a->live);
+  g_atomic_int_inc (&a->ref);
+  g_mutex_unlock (&a->lock);
+
+  if (!c->slab)
+    c->data = g_malloc (size);
+
+  gst_buffer_extract (buf, 0, c->data, size);
+  out = gst_buffer_new ();
+  gst_buffer_append_memory (out, gst_memory_new_wrapped (0, c->data, size,
+          0, size, c, chunk_release));
+  gst_buffer_copy_into (out, buf, GST_BUFFER_COPY_METADATA, 0, -1);
+
+  return out;
+}
+
+void
+arena_stats (Arena *a, guint64 *live, guint64 *peak, guint64 *reserved)
+{
+  g_mutex_lock (&a->lock);
+  *live = a->live;
+  *peak = a->peak;
+  *reserved = (guint64) a->slabs->len * a->slab_size;
+  g_mutex_unlock (&a->lock);
+}
+
+/* The slabs go once the last fragment still held by a reader does */
+void
+arena_free (Arena *a)
+{
+  if (a)
+    arena_unref (a);
+}
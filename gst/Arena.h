@@ -0,0 +1,21 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <gst/gst.h>
+
+typedef struct Arena Arena;
+
+Arena*          arena_new (gsize, guint, guint);
+GstBuffer*      arena_copy (Arena*, GstBuffer*);
+void            arena_stats (Arena*, guint64*, guint64*, guint64*);
+void            arena_free (Arena*);
+
+#endif
@@ -0,0 +1,151 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * One time GStreamer setup. The registry scan, loading the plugins and
+ * x264's first encoder instance all happen once at startup, instead of
+ * during whoever plays first. Elements are then made from factories
+ * that are already resolved and loaded.
+ */
+
+#include <gst/gst.h>
+
+#include <string.h>
+
+#include "Elements.h"
+
+#define WARMUP_TIMEOUT_MS     5000
+
+/* every element a session or a snapshot may be built from */
+static const gchar *names[] = {
+  "v4l2src", "appsrc", "rtpbin", "decodebin", "compositor",
+  "queue", "videoscale", "videoconvert", "capsfilter", "x264enc",
+  "identity", "qtmux", "fakesink", "tee", "rtph264pay", "appsink",
+  "videotestsrc",
+};
+
+static GHashTable *factories;
+
+static gdouble
+ms_since (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+/* runs a few frames through the encoder, so that its code and tables
+ * are paged in and initialized before the first session needs them */
+static void
+warm_up_encoder (void)
+{
+  GstElement *bin = gst_pipeline_new (NULL);
+  GstElement *src = make_element ("videotestsrc");
+  GstElement *conv = make_element ("videoconvert");
+  GstElement *enc = make_element ("x264enc");
+  GstElement *sink = make_element ("fakesink");
+  GstCaps *caps;
+  GstBus *bus;
+  GstMessage *msg;
+
+  if (!src || !conv || !enc || !sink) {
+    g_print ("encoder warm-up skipped, elements missing\n");
+    if (src)
+      gst_object_unref (src);
+    if (conv)
+      gst_object_unref (conv);
+    if (enc)
+      gst_object_unref (enc);
+    if (sink)
+      gst_object_unref (sink);
+    gst_object_unref (bin);
+    return;
+  }
+
+  g_object_set (G_OBJECT (src), "num-buffers", 2, NULL);
+  g_object_set (G_OBJECT (enc), "tune", 4, "threads", 1, NULL);
+  g_object_set (G_OBJECT (sink), "sync", FALSE, NULL);
+  gst_bin_add_many (GST_BIN (bin), src, conv, enc, sink, NULL);
+  caps = gst_caps_new_simple ("video/x-raw",
+      "width", G_TYPE_INT, 320,
+      "height", G_TYPE_INT, 240,
+      NULL);
+  gst_element_link_filtered (src, conv, caps);
+  gst_caps_unref (caps);
+  gst_element_link_many (conv, enc, sink, NULL);
+
+  gst_element_set_state (bin, GST_STATE_PLAYING);
+  bus = gst_pipeline_get_bus (GST_PIPELINE (bin));
+  msg = gst_bus_timed_pop_filtered (bus, WARMUP_TIMEOUT_MS * GST_MSECOND,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (!msg || GST_MESSAGE_TYPE (msg) != GST_MESSAGE_EOS)
+    g_print ("encoder warm-up did not finish\n");
+  if (msg)
+    gst_message_unref (msg);
+  gst_object_unref (bus);
+  gst_element_set_state (bin, GST_STATE_NULL);
+  gst_object_unref (bin);
+}
+
+static gpointer
+init_once (gpointer data)
+{
+  gint64 start = g_get_monotonic_time (), step;
+  gdouble init_ms, load_ms;
+  guint i, loaded = 0;
+
+  gst_init (NULL, NULL);
+  init_ms = ms_since (start);
+
+  step = g_get_monotonic_time ();
+  factories = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      gst_object_unref);
+  for (i = 0; i < G_N_ELEMENTS (names); i++) {
+    GstElementFactory *f = gst_element_factory_find (names[i]);
+    GstPluginFeature *feature;
+
+    if (!f) {
+      g_print ("no element %s\n", names[i]);
+      continue;
+    }
+    feature = gst_plugin_feature_load (GST_PLUGIN_FEATURE (f));
+    gst_object_unref (f);
+    if (feature) {
+      g_hash_table_insert (factories, (gpointer) names[i], feature);
+      loaded++;
+    }
+  }
+  load_ms = ms_since (step);
+
+  step = g_get_monotonic_time ();
+  warm_up_encoder ();
+
+  g_print ("media init: gst_init %.1f ms, %u/%u plugins loaded in %.1f ms, "
+      "encoder warm-up %.1f ms, total %.1f ms\n", init_ms, loaded,
+      (guint) G_N_ELEMENTS (names), load_ms, ms_since (step), ms_since (start));
+
+  return NULL;
+}
+
+/* safe to call any number of times, from any thread */
+void
+initMedia (void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, init_once, NULL);
+}
+
+GstElement*
+make_element (const char *name)
+{
+  GstElementFactory *f = factories ? g_hash_table_lookup (factories, name) : NULL;
+
+  if (f)
+    return gst_element_factory_create (f, NULL);
+
+  return gst_element_factory_make (name, NULL);
+}
@@ -0,0 +1,17 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __ELEMENTS_H__
+#define __ELEMENTS_H__
+
+#include <gst/gst.h>
+
+void            initMedia (void);
+GstElement*     make_element (const char*);
+
+#endif
@@ -10,24 +10,470 @@
 #include <gst/video/video.h>
 #include <gst/video/gstvideometa.h>
 #include <gst/base/gstadapter.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "Upnp.h"
+#include "Elements.h"
+#include "Profile.h"
+#include "Ingest.h"
+#include "TaskPool.h"
+#include "Arena.h"
+#include "Snapshot.h"
+#include "Motion.h"
+#include "Multicast.h"
+#include "ShmRing.h"
 #include "GstSource.h"
 
+#define FRAME_DURATION        ((GstClockTime)(GST_SECOND / 30))
+
+#define MONITOR_INTERVAL_MS   500
+#define BACKLOG_HIGH_MS       1000
+#define BACKLOG_LOW_MS        200
+#define CALM_INTERVALS        4
+#define MIN_BITRATE           150
+#define MAX_DECIMATE          4
+
+#define KEYFRAME_INTERVAL     60
+#define KEYFRAME_MIN_GAP_MS   500
+#define READER_MAX_BACKLOG_MS 3000
+#define LIVE_MAX_BACKLOG_MS   300
+#define READER_WAIT_MS        500
+
+#define ARENA_SLAB_SIZE       (256 * 1024)
+#define ARENA_MAX_GROWTH      4
+
+#define SNAPSHOT_WAIT_MS      500
+
+/* frames that barely differ from the last encoded one are not encoded,
+ * but one goes through at least every STATIC_KEEPALIVE_MS */
+#define STATIC_THRESHOLD      6
+#define STATIC_KEEPALIVE_MS   1000
+
+#define RTP_LATENCY_MS        50
+
+#define MOSAIC_MAX_TILES      16
+
+/* a session nobody reads for this long stops passing frames on until a
+ * reader comes back, long enough for renderers that reconnect */
+#define IDLE_GRACE_MS         5000
+
+/* multicast output: hops the packets may travel, and how much faster than
+ * the encoder's bitrate they may leave */
+#define MCAST_TTL             4
+#define MCAST_PACE_FACTOR     4
+
+/* shared memory output: seconds of stream the ring holds */
+#define SHM_RING_SECONDS      4
+#define SHM_RING_SLOTS        256
+
+static gint sessions;
+
+/* how far behind the clock the encoder output may get before frames are
+ * shed, and how close it has to come back before shedding is undone */
+#define SHED_LAG_HIGH_MS      250
+#define SHED_LAG_LOW_MS       80
+#define SHED_PRESET           1   /* ultrafast */
+#define ENCODER_PRESET        6   /* medium, x264enc's default */
+
+enum {
+  SHED_NONE = 0,
+  SHED_LEAKY,
+  SHED_DECIMATE,
+  SHED_PRESET_DOWN
+};
+
 struct GstSource {
   GMutex dlock;
+  GCond dcond;
+  gint ref;
   GstBin *bin;
   GstAdapter *adapter;
+  GstBuffer *header;
+  GstBuffer *fragment;
+  Arena *arena;
+  GList *readers;
   int bufferCount;
-  gchar *device;
+  GPtrArray *devices;
+  const StreamProfile *profile;
+  gchar *features;
   gchar *url;
   GstClockTime lTime;
+  GstClockTime lPts;
+
+  GstElement *venc;
+  GstElement *vsize;
+  IngestStream *ingest;
+  GstTaskPool *pool;
+  gint cpu;
+  GThread *monitor;
+  GMutex mlock;
+  GCond mcond;
+  gboolean stopping;
+
+  /* forced keyframes, under mlock */
+  gint64 lastKeyframe;
+  gboolean keyPending;
+  guint keyCount;
+
+  /* rate control, owned by the monitor thread */
+  guint bitrate;
+  guint decimate;
+  guint calm;
+  guint64 produced;
+  guint64 lastProduced;
+  guint frameCount;
+
+  /* load shedding, owned by the monitor thread */
+  GstElement *lqueue;
+  guint shed;
+  guint shedDecimate;
+  guint shedCalm;
+  guint preset;
+  gint encLag;
+  gint overruns;
+  gint restarts;
+  struct SourceStats stats;   /* under mlock */
+
+  /* snapshots, a frame is only held while somebody asks for one */
+  GMutex slock;
+  GCond scond;
+  gint snapWanted;
+  GstBuffer *snapFrame;
+  GstCaps *snapCaps;
+
+  /* static scene detection, streaming thread only */
+  guint staticThreshold;
+  GstClockTime staticKeepAlive;
+  GstCaps *staticCaps;
+  GstVideoInfo staticInfo;
+  guint8 *staticRef;
+  GstClockTime staticLast;
+  gint staticPass;
+  gint staticSkipped;
+
+  /* multicast output, only when a group was asked for */
+  McastSender *mcast;
+  GstElement *pay;
+  gchar *mcastGroup;
+  gchar *mcastIface;
+  gint mcastPort;
+  gint mcastTtl;
+
+  /* demand, frames only go past the capture while somebody wants them */
+  gint idle;
+  gint64 lastDemand;      /* monitor thread only */
+
+  /* shared memory output, under dlock */
+  ShmRing *shm;
+  gboolean shmInit;
+
+  /* CPU used by the streaming threads, under mlock */
+  GArray *threads;
+  guint64 cpuDone;
+};
+
+typedef struct {
+  pthread_t thread;
+  clockid_t clock;
+  guint64 start;
+} StreamThread;
+
+struct GstReader {
+  GstSource *src;
+  GQueue fragments;
+  gsize offset;
+  gsize queued;
+  guint64 drained;
+  guint64 lastDrained;
+  gboolean needHeader;
+  /* live readers keep a short backlog and only ever resume at a
+   * fragment holding a keyframe */
+  gboolean live;
+  gboolean waitKey;
 };
 
+static void
+source_unref (GstSource *dev)
+{
+  if (!g_atomic_int_dec_and_test (&dev->ref))
+    return;
+
+  if (dev->adapter)
+    g_object_unref (dev->adapter);
+  if (dev->header)
+    gst_buffer_unref (dev->header);
+  if (dev->fragment)
+    gst_buffer_unref (dev->fragment);
+  arena_free (dev->arena);
+  g_mutex_clear (&dev->dlock);
+  g_cond_clear (&dev->dcond);
+  g_mutex_clear (&dev->mlock);
+  g_cond_clear (&dev->mcond);
+  gst_caps_replace (&dev->staticCaps, NULL);
+  g_free (dev->staticRef);
+  gst_buffer_replace (&dev->snapFrame, NULL);
+  gst_caps_replace (&dev->snapCaps, NULL);
+  g_mutex_clear (&dev->slock);
+  g_cond_clear (&dev->scond);
+  if (dev->url)
+    g_free (dev->url);
+  g_free (dev->mcastGroup);
+  g_free (dev->mcastIface);
+  if (dev->pay)
+    gst_object_unref (dev->pay);
+  g_free (dev->features);
+  g_ptr_array_free (dev->devices, TRUE);
+  g_array_free (dev->threads, TRUE);
+  if (dev->pool)
+    gst_object_unref (dev->pool);
+  free (dev);
+}
+
+static void
+send_keyframe_request (GstSource *dev, guint count)
+{
+  GstPad *pad = gst_element_get_static_pad (dev->venc, "src");
+
+  /* the keyframe needs a frame, do not wait for the scene to move */
+  g_atomic_int_set (&dev->staticPass, 1);
+  gst_pad_send_event (pad,
+      gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE,
+        TRUE, count));
+  gst_object_unref (pad);
+}
+
+/* Asks the encoder for an IDR now, or once KEYFRAME_MIN_GAP_MS has passed
+ * since the last one, however many joins ask in the meantime. */
+static void
+request_keyframe (GstSource *dev, const char *why)
+{
+  gint64 now = g_get_monotonic_time ();
+  gboolean send = FALSE;
+  guint count = 0;
+
+  g_mutex_lock (&dev->mlock);
+  if (now - dev->lastKeyframe >= KEYFRAME_MIN_GAP_MS * 1000) {
+    dev->lastKeyframe = now;
+    dev->keyPending = FALSE;
+    count = ++dev->keyCount;
+    send = TRUE;
+  } else {
+    dev->keyPending = TRUE;
+  }
+  g_mutex_unlock (&dev->mlock);
+
+  if (send) {
+    g_print ("forcing keyframe: %s\n", why);
+    send_keyframe_request (dev, count);
+  }
+}
+
+/* Drops everything a reader has queued except the fragment it is in the
+ * middle of, it picks up again at the next fragment */
+static void
+reader_skip (GstReader *r)
+{
+  GstBuffer *head = NULL;
+
+  if (r->offset > 0)
+    head = g_queue_pop_head (&r->fragments);
+
+  g_queue_free_full (&r->fragments, (GDestroyNotify) gst_buffer_unref);
+  g_queue_init (&r->fragments);
+  r->queued = 0;
+
+  if (head) {
+    g_queue_push_tail (&r->fragments, head);
+    r->queued = gst_buffer_get_size (head) - r->offset;
+  }
+}
+
+/* called with dlock held */
+static void
+publish_fragment (GstSource *dev, GstBuffer *frag)
+{
+  GList *l;
+  gsize limit = (gsize) dev->profile->bitrate * READER_MAX_BACKLOG_MS / 8;
+  gsize live_limit = (gsize) dev->profile->bitrate * LIVE_MAX_BACKLOG_MS / 8;
+  gboolean key = !GST_BUFFER_FLAG_IS_SET (frag, GST_BUFFER_FLAG_DELTA_UNIT);
+  gboolean dropped = FALSE;
+
+  for (l = dev->readers; l != NULL; l = l->next) {
+    GstReader *r = l->data;
+
+    if (r->needHeader) {
+      if (!dev->header)
+        continue;
+      g_queue_push_tail (&r->fragments, gst_buffer_ref (dev->header));
+      r->queued += gst_buffer_get_size (dev->header);
+      r->needHeader = FALSE;
+    }
+    if (r->live) {
+      if (r->queued > live_limit && !r->waitKey) {
+        /* a header not sent yet has to stay, nothing plays without it */
+        GstBuffer *hdr = g_queue_peek_head (&r->fragments) == dev->header ?
+            g_queue_pop_head (&r->fragments) : NULL;
+
+        reader_skip (r);
+        if (hdr) {
+          g_queue_push_head (&r->fragments, hdr);
+          r->queued = gst_buffer_get_size (hdr);
+        }
+        r->waitKey = TRUE;
+        dropped = TRUE;
+      }
+      if (r->waitKey && !key)
+        continue;
+      r->waitKey = FALSE;
+    } else if (r->queued > limit) {
+      reader_skip (r);
+      dropped = TRUE;
+    }
+    g_queue_push_tail (&r->fragments, gst_buffer_ref (frag));
+    r->queued += gst_buffer_get_size (frag);
+  }
+  dev->produced += gst_buffer_get_size (frag);
+  g_cond_broadcast (&dev->dcond);
+
+  if (dev->shm) {
+    if (!dev->shmInit && dev->header) {
+      shm_ring_set_init (dev->shm, dev->header);
+      dev->shmInit = TRUE;
+    }
+    shm_ring_publish (dev->shm, frag, key ? SHM_RING_KEY : 0);
+  }
+
+  if (dropped)
+    request_keyframe (dev, "reader fell behind");
+}
+
+/* Whether any sample in a moof is a sync sample, going by the sample
+ * flags in tfhd and trun (sample_is_non_sync_sample clear) */
+static gboolean
+moof_has_sync (const guint8 *data, gsize size)
+{
+  const guint8 *end = data + size, *traf, *traf_end, *b, *p;
+  guint32 bsize, tflags, defaults = 0x10000;
+
+  for (traf = data + 8; traf + 8 <= end; traf += bsize) {
+    bsize = GST_READ_UINT32_BE (traf);
+    if (bsize < 8 || traf + bsize > end)
+      return FALSE;
+    if (GST_READ_UINT32_LE (traf + 4) != GST_MAKE_FOURCC ('t', 'r', 'a', 'f'))
+      continue;
+
+    traf_end = traf + bsize;
+    for (b = traf + 8; b + 16 <= traf_end; b += GST_READ_UINT32_BE (b)) {
+      guint32 type = GST_READ_UINT32_LE (b + 4);
+      guint32 len = GST_READ_UINT32_BE (b);
+
+      if (len < 16 || b + len > traf_end)
+        break;
+      tflags = GST_READ_UINT32_BE (b + 8) & 0xffffff;
+      p = b + 16;
+
+      if (type == GST_MAKE_FOURCC ('t', 'f', 'h', 'd')) {
+        p += (tflags & 0x1 ? 8 : 0) + (tflags & 0x2 ? 4 : 0) +
+            (tflags & 0x8 ? 4 : 0) + (tflags & 0x10 ? 4 : 0);
+        if ((tflags & 0x20) && p + 4 <= b + len)
+          defaults = GST_READ_UINT32_BE (p);
+      } else if (type == GST_MAKE_FOURCC ('t', 'r', 'u', 'n')) {
+        guint32 count = GST_READ_UINT32_BE (b + 12), i, flags;
+        guint stride = ((tflags & 0x100) ? 4 : 0) + ((tflags & 0x200) ? 4 : 0) +
+            ((tflags & 0x400) ? 4 : 0) + ((tflags & 0x800) ? 4 : 0);
+
+        if (tflags & 0x1)
+          p += 4;
+        if (tflags & 0x4) {
+          if (p + 4 > b + len)
+            break;
+          if (!(GST_READ_UINT32_BE (p) & 0x10000))
+            return TRUE;
+          p += 4;
+        }
+        for (i = 0; i < count && p + stride <= b + len; i++, p += stride) {
+          flags = defaults;
+          if (tflags & 0x400)
+            flags = GST_READ_UINT32_BE (p + ((tflags & 0x100) ? 4 : 0) +
+                ((tflags & 0x200) ? 4 : 0));
+          if (!(flags & 0x10000))
+            return TRUE;
+        }
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+/* Split the muxer output into top level boxes: everything before the
+ * first moof is the header (ftyp + moov), and every moof + mdat pair is
+ * one fragment that a reader can start from. Called with dlock held. */
+static void
+parse_boxes (GstSource *dev)
+{
+  guint8 hdr[16];
+  guint64 size;
+  guint32 type;
+  gsize avail;
+
+  while ((avail = gst_adapter_available (dev->adapter)) >= 8) {
+    gst_adapter_copy (dev->adapter, hdr, 0, 8);
+    size = GST_READ_UINT32_BE (hdr);
+    type = GST_READ_UINT32_LE (hdr + 4);
+
+    if (size == 1) {
+      if (avail < 16)
+        break;
+      gst_adapter_copy (dev->adapter, hdr, 0, 16);
+      size = GST_READ_UINT64_BE (hdr + 8);
+    } else if (size == 0) {
+      size = avail;
+    }
+
+    if (avail < size)
+      break;
+
+    GstBuffer *box = gst_adapter_take_buffer_fast (dev->adapter, size);
+
+    if (type == GST_MAKE_FOURCC ('m', 'o', 'o', 'f')) {
+      if (dev->fragment)
+        gst_buffer_unref (dev->fragment);
+      dev->fragment = box;
+    } else if (dev->fragment) {
+      dev->fragment = gst_buffer_append (dev->fragment, box);
+      if (type == GST_MAKE_FOURCC ('m', 'd', 'a', 't')) {
+        /* readers hold on to the arena copy, the muxer's buffers go
+         * back right away */
+        GstBuffer *frag = arena_copy (dev->arena, dev->fragment);
+        GstMapInfo map;
+
+        /* live readers can only resume at a fragment with a keyframe */
+        if (gst_buffer_map (frag, &map, GST_MAP_READ)) {
+          if (!moof_has_sync (map.data, map.size))
+            GST_BUFFER_FLAG_SET (frag, GST_BUFFER_FLAG_DELTA_UNIT);
+          gst_buffer_unmap (frag, &map);
+        }
+        gst_buffer_unref (dev->fragment);
+        dev->fragment = NULL;
+        publish_fragment (dev, frag);
+        gst_buffer_unref (frag);
+      }
+    } else if (dev->header) {
+      dev->header = gst_buffer_append (dev->header, box);
+    } else {
+      dev->header = box;
+    }
+  }
+}
+
 static void
 frame_handoff_cb (GstElement *ele, GstBuffer *buf,
         GstPad *pad, gpointer data)
@@ -36,13 +482,15 @@ frame_handoff_cb (GstElement *ele, GstBuffer *buf,
 
   g_mutex_lock (&dev->dlock);
   gst_adapter_push (dev->adapter, gst_buffer_ref(buf));
-  g_mutex_unlock (&dev->dlock);
+  parse_boxes (dev);
 
   if (G_UNLIKELY (dev->bufferCount == 0)) {
-	  g_print ("SeEnding PLAY to the DMR\n");
-    up_play (dev->device, dev->url);
+	  g_print ("SeEnding PLAY to the DMR(s)\n");
+    up_play_group ((char**)dev->devices->pdata, dev->devices->len, dev->url,
+        dev->profile->name);
   }
   dev->bufferCount++;
+  g_mutex_unlock (&dev->dlock);
 }
 
 static GstPadProbeReturn
@@ -51,18 +499,428 @@ probe_cb (GstPad* pad, GstPadProbeInfo* info, gpointer data)
   GstSource* dev = data;
   GstBuffer* buf = GST_BUFFER_CAST (info->data);
 
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  GstClock *clock;
+
+  /* how far the encoded frame trails the clock, the monitor keeps the
+   * worst one per interval */
+  if (GST_CLOCK_TIME_IS_VALID (pts) &&
+      (clock = gst_element_get_clock (dev->venc))) {
+    GstClockTime now = gst_clock_get_time (clock) -
+        gst_element_get_base_time (dev->venc);
+    gint lag = now > pts ? (gint) ((now - pts) / GST_MSECOND) : 0;
+
+    if (lag > g_atomic_int_get (&dev->encLag))
+      g_atomic_int_set (&dev->encLag, lag);
+    gst_object_unref (clock);
+  }
+
   if (G_UNLIKELY (!GST_CLOCK_TIME_IS_VALID (dev->lTime))) {
     dev->lTime = GST_BUFFER_DTS (buf);
   } else {
-    dev->lTime += (GstClockTime)(GST_SECOND / 30);
+    guint64 frames = 1;
+
+    /* stay on the 30 fps grid, but frames dropped before the encoder
+     * still take up their slots so the timeline keeps its pace */
+    if (GST_CLOCK_TIME_IS_VALID (pts) && GST_CLOCK_TIME_IS_VALID (dev->lPts)
+        && pts > dev->lPts)
+      frames = MAX (1, (pts - dev->lPts + FRAME_DURATION / 2) / FRAME_DURATION);
+
+    dev->lTime += frames * FRAME_DURATION;
     GST_BUFFER_DTS (buf) = dev->lTime;
     GST_BUFFER_PTS (buf) = GST_BUFFER_DTS (buf); 
   }
+  dev->lPts = pts;
+
+  GST_BUFFER_DURATION(buf) = FRAME_DURATION; 
+  return GST_PAD_PROBE_OK;
+}
+
+/* Hands the next converted frame to whoever waits in getSnapshot. Costs
+ * two atomic reads per frame otherwise; no capture buffer is held on to.
+ * A suspended session lets frames this far only for the snapshot, they
+ * stop here rather than go on to the encoder. */
+static GstPadProbeReturn
+snapshot_cb (GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+  GstSource* dev = data;
+
+  if (G_UNLIKELY (g_atomic_int_get (&dev->snapWanted))) {
+    g_mutex_lock (&dev->slock);
+    if (dev->snapWanted && !dev->snapFrame) {
+      dev->snapFrame = gst_buffer_ref (GST_PAD_PROBE_INFO_BUFFER (info));
+      dev->snapCaps = gst_pad_get_current_caps (pad);
+      g_cond_broadcast (&dev->scond);
+    }
+    g_mutex_unlock (&dev->slock);
+  }
+
+  return g_atomic_int_get (&dev->idle) ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+/* Drops frames whose luma is within the threshold of the last frame that
+ * went to the encoder. probe_cb counts the slots they leave behind, so
+ * the timeline stays right however long the scene holds still. */
+static GstPadProbeReturn
+static_cb (GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+  GstSource* dev = data;
+  GstBuffer* buf = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buf);
+  GstCaps *caps = gst_pad_get_current_caps (pad);
+  GstVideoFrame frame;
+  gboolean changed = TRUE;
+  int width, height, y;
+
+  if (caps != dev->staticCaps) {
+    gst_caps_replace (&dev->staticCaps, caps);
+    g_free (dev->staticRef);
+    dev->staticRef = NULL;
+    if (!caps || !gst_video_info_from_caps (&dev->staticInfo, caps) ||
+        !GST_VIDEO_INFO_IS_YUV (&dev->staticInfo) ||
+        GST_VIDEO_INFO_COMP_PSTRIDE (&dev->staticInfo, 0) != 1)
+      gst_caps_replace (&dev->staticCaps, NULL);
+  }
+  if (caps)
+    gst_caps_unref (caps);
+  /* no planar luma to look at, everything goes through */
+  if (!dev->staticCaps ||
+      !gst_video_frame_map (&frame, &dev->staticInfo, buf, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+
+  width = GST_VIDEO_FRAME_COMP_WIDTH (&frame, 0);
+  height = GST_VIDEO_FRAME_COMP_HEIGHT (&frame, 0);
+
+  if (dev->staticRef && !g_atomic_int_get (&dev->staticPass) &&
+      GST_CLOCK_TIME_IS_VALID (pts) &&
+      GST_CLOCK_TIME_IS_VALID (dev->staticLast) &&
+      pts < dev->staticLast + dev->staticKeepAlive)
+    changed = motion_luma_changed (GST_VIDEO_FRAME_COMP_DATA (&frame, 0),
+        GST_VIDEO_FRAME_COMP_STRIDE (&frame, 0), dev->staticRef, width,
+        width, height, dev->staticThreshold);
+
+  if (changed) {
+    if (!dev->staticRef)
+      dev->staticRef = g_malloc (width * height);
+    for (y = 0; y < height; y++)
+      memcpy (dev->staticRef + y * width, GST_VIDEO_FRAME_COMP_DATA (&frame, 0)
+          + y * GST_VIDEO_FRAME_COMP_STRIDE (&frame, 0), width);
+    dev->staticLast = pts;
+    g_atomic_int_set (&dev->staticPass, 0);
+  }
+  gst_video_frame_unmap (&frame);
+
+  if (!changed) {
+    g_atomic_int_inc (&dev->staticSkipped);
+    return GST_PAD_PROBE_DROP;
+  }
 
-  GST_BUFFER_DURATION(buf) = (GstClockTime)(GST_SECOND / 30); 
   return GST_PAD_PROBE_OK;
 }
 
+/* a snapshot asked of a suspended session still needs a frame to get
+ * as far as snapshot_cb */
+static GstPadProbeReturn
+idle_cb (GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+  GstSource* dev = data;
+
+  if (g_atomic_int_get (&dev->idle) && !g_atomic_int_get (&dev->snapWanted))
+    return GST_PAD_PROBE_DROP;
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Suspends a session nobody has read for IDLE_GRACE_MS: frames are
+ * dropped right after capture, so nothing gets converted or encoded.
+ * Multicast and shared memory output have no readers to count, they
+ * always want frames. Resuming is up to reader_new. */
+static void
+check_demand (GstSource *dev)
+{
+  gint64 now = g_get_monotonic_time ();
+  gboolean wanted;
+
+  g_mutex_lock (&dev->dlock);
+  wanted = dev->readers || dev->mcast || dev->shm;
+  g_mutex_unlock (&dev->dlock);
+
+  if (wanted || !dev->lastDemand) {
+    dev->lastDemand = now;
+  } else if (!g_atomic_int_get (&dev->idle) &&
+      now - dev->lastDemand >= IDLE_GRACE_MS * 1000) {
+    g_print ("no readers for %d ms, suspending\n", IDLE_GRACE_MS);
+    g_atomic_int_set (&dev->idle, 1);
+    g_mutex_lock (&dev->mlock);
+    dev->stats.Suspends++;
+    g_mutex_unlock (&dev->mlock);
+  }
+}
+
+static GstPadProbeReturn
+decimate_cb (GstPad* pad, GstPadProbeInfo* info, gpointer data)
+{
+  GstSource* dev = data;
+  guint decimate = MAX (g_atomic_int_get (&dev->decimate),
+      g_atomic_int_get (&dev->shedDecimate));
+
+  if (decimate > 1 && (dev->frameCount++ % decimate) != 0)
+    return GST_PAD_PROBE_DROP;
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Backs the encoder off while the slowest reader falls behind and
+ * climbs back once everybody keeps up again. Bitrate goes first, then
+ * frames are dropped ahead of the encoder. The resolution stays, qtmux
+ * cannot renegotiate it in the middle of a stream. */
+static void
+adapt_rate (GstSource *dev)
+{
+  guint64 backlog = 0, drained = G_MAXUINT64, produced;
+  guint bitrate = dev->bitrate, decimate = dev->decimate;
+  guint64 backlogMs;
+  GList *l;
+
+  g_mutex_lock (&dev->dlock);
+  if (!dev->readers) {
+    g_mutex_unlock (&dev->dlock);
+    return;
+  }
+  for (l = dev->readers; l != NULL; l = l->next) {
+    GstReader *r = l->data;
+
+    backlog = MAX (backlog, r->queued);
+    drained = MIN (drained, r->drained - r->lastDrained);
+    r->lastDrained = r->drained;
+  }
+  produced = dev->produced - dev->lastProduced;
+  dev->lastProduced = dev->produced;
+  g_mutex_unlock (&dev->dlock);
+
+  /* bytes * 8 / kbit/s gives milliseconds worth of stream */
+  backlogMs = backlog * 8 / bitrate;
+
+  if (backlogMs > BACKLOG_HIGH_MS ||
+      (backlogMs > BACKLOG_LOW_MS && drained * 10 < produced * 9)) {
+    dev->calm = 0;
+    if (bitrate > MIN_BITRATE)
+      bitrate = MAX (MIN_BITRATE, bitrate * 3 / 4);
+    else if (decimate < MAX_DECIMATE)
+      decimate++;
+  } else if (backlogMs < BACKLOG_LOW_MS && ++dev->calm >= CALM_INTERVALS) {
+    dev->calm = 0;
+    if (decimate > 1)
+      decimate--;
+    else if (bitrate < (guint) dev->profile->bitrate)
+      bitrate = MIN ((guint) dev->profile->bitrate, bitrate * 5 / 4);
+  }
+
+  if (bitrate != dev->bitrate) {
+    g_print ("backlog %" G_GUINT64_FORMAT " ms, bitrate %u -> %u kbit/s\n",
+        backlogMs, dev->bitrate, bitrate);
+    dev->bitrate = bitrate;
+    g_object_set (G_OBJECT (dev->venc), "bitrate", bitrate, NULL);
+  }
+  if (decimate != dev->decimate) {
+    g_print ("backlog %" G_GUINT64_FORMAT " ms, passing 1/%u frames\n",
+        backlogMs, decimate);
+    g_atomic_int_set (&dev->decimate, decimate);
+  }
+}
+
+static GstPadProbeReturn
+restart_encoder_cb (GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+  GstSource *dev = data;
+  GstPad *sinkpad = gst_element_get_static_pad (dev->venc, "sink");
+
+  /* x264enc only takes a new preset when stopped. Relinking marks the
+   * scaler's sticky events pending, so the restarted encoder gets caps
+   * and segment again before the next frame. */
+  gst_pad_unlink (pad, sinkpad);
+  gst_element_set_state (dev->venc, GST_STATE_NULL);
+  g_object_set (G_OBJECT (dev->venc), "speed-preset",
+      g_atomic_int_get (&dev->preset), NULL);
+  gst_element_sync_state_with_parent (dev->venc);
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+
+  g_atomic_int_inc (&dev->restarts);
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+set_preset (GstSource *dev, guint preset)
+{
+  GstPad *pad = gst_element_get_static_pad (dev->vsize, "src");
+
+  g_atomic_int_set (&dev->preset, preset);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER,
+      restart_encoder_cb, dev, NULL);
+  gst_object_unref (pad);
+}
+
+static void
+overrun_cb (GstElement *queue, gpointer data)
+{
+  GstSource *dev = data;
+
+  g_atomic_int_inc (&dev->overruns);
+}
+
+/* Keeps the session live when the encoder cannot keep up, at the cost of
+ * frame rate and then quality: first stale frames ahead of the scaler are
+ * dropped instead of queued, then frames are decimated and last the
+ * encoder is restarted on a faster preset. Undone in reverse order once
+ * the lag has stayed low for a while. */
+static void
+shed_load (GstSource *dev, gint lag)
+{
+  guint shed = dev->shed, decimate = dev->shedDecimate;
+
+  if (lag > SHED_LAG_HIGH_MS) {
+    dev->shedCalm = 0;
+    if (shed == SHED_NONE) {
+      shed = SHED_LEAKY;
+    } else if (shed == SHED_LEAKY) {
+      shed = SHED_DECIMATE;
+      decimate = 2;
+    } else if (shed == SHED_DECIMATE && decimate < MAX_DECIMATE) {
+      decimate++;
+    } else if (shed == SHED_DECIMATE) {
+      shed = SHED_PRESET_DOWN;
+    }
+  } else if (lag < SHED_LAG_LOW_MS && shed != SHED_NONE &&
+      ++dev->shedCalm >= CALM_INTERVALS * 2) {
+    dev->shedCalm = 0;
+    if (shed == SHED_PRESET_DOWN)
+      shed = SHED_DECIMATE;
+    else if (shed == SHED_DECIMATE && decimate > 2)
+      decimate--;
+    else if (shed == SHED_DECIMATE) {
+      shed = SHED_LEAKY;
+      decimate = 1;
+    } else
+      shed = SHED_NONE;
+  }
+
+  if (shed == dev->shed && decimate == dev->shedDecimate)
+    return;
+
+  g_print ("encoder lag %d ms, shedding level %u -> %u, passing 1/%u frames\n",
+      lag, dev->shed, shed, MAX (decimate, 1));
+
+  g_mutex_lock (&dev->mlock);
+  if (shed > dev->shed && shed == SHED_LEAKY)
+    dev->stats.LeakyEnabled++;
+  if (shed > dev->shed && shed == SHED_PRESET_DOWN)
+    dev->stats.PresetDowngrades++;
+  if (decimate > dev->shedDecimate)
+    dev->stats.DecimateSteps++;
+  g_mutex_unlock (&dev->mlock);
+
+  if ((shed >= SHED_LEAKY) != (dev->shed >= SHED_LEAKY) && dev->lqueue)
+    g_object_set (G_OBJECT (dev->lqueue), "leaky",
+        shed >= SHED_LEAKY ? 2 : 0, NULL);
+  if (shed == SHED_PRESET_DOWN)
+    set_preset (dev, SHED_PRESET);
+  else if (dev->shed == SHED_PRESET_DOWN)
+    set_preset (dev, ENCODER_PRESET);
+  g_atomic_int_set (&dev->shedDecimate, decimate);
+  dev->shed = shed;
+}
+
+/* Drains the pipeline bus, nobody else watches it */
+static void
+poll_bus (GstSource *dev)
+{
+  GstBus *bus = gst_element_get_bus (GST_ELEMENT (dev->bin));
+  GstMessage *msg;
+
+  while ((msg = gst_bus_pop (bus))) {
+    GError *err = NULL;
+    gchar *dbg = NULL;
+
+    switch (GST_MESSAGE_TYPE (msg)) {
+      case GST_MESSAGE_LATENCY:
+        gst_bin_recalculate_latency (dev->bin);
+        g_mutex_lock (&dev->mlock);
+        dev->stats.LatencyMessages++;
+        g_mutex_unlock (&dev->mlock);
+        break;
+      case GST_MESSAGE_ERROR:
+      case GST_MESSAGE_WARNING:
+        if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR)
+          gst_message_parse_error (msg, &err, &dbg);
+        else
+          gst_message_parse_warning (msg, &err, &dbg);
+        g_print ("%s from %s: %s\n",
+            GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR ? "error" : "warning",
+            GST_OBJECT_NAME (GST_MESSAGE_SRC (msg)), err->message);
+        g_mutex_lock (&dev->mlock);
+        if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR)
+          dev->stats.Errors++;
+        else
+          dev->stats.Warnings++;
+        g_mutex_unlock (&dev->mlock);
+        g_error_free (err);
+        g_free (dbg);
+        break;
+      default:
+        break;
+    }
+    gst_message_unref (msg);
+  }
+  gst_object_unref (bus);
+}
+
+static gpointer
+monitor_thread (gpointer data)
+{
+  GstSource *dev = data;
+  gint64 deadline;
+
+  g_mutex_lock (&dev->mlock);
+  while (!dev->stopping) {
+    deadline = g_get_monotonic_time () + MONITOR_INTERVAL_MS * 1000;
+    while (!dev->stopping && g_cond_wait_until (&dev->mcond, &dev->mlock, deadline))
+      ;
+    if (dev->stopping)
+      break;
+
+    g_mutex_unlock (&dev->mlock);
+    check_demand (dev);
+    adapt_rate (dev);
+    poll_bus (dev);
+    {
+      gint lag = g_atomic_int_get (&dev->encLag);
+
+      g_atomic_int_set (&dev->encLag, 0);
+      shed_load (dev, lag);
+      g_mutex_lock (&dev->mlock);
+      dev->stats.EncoderLagMs = lag;
+      g_mutex_unlock (&dev->mlock);
+    }
+    g_mutex_lock (&dev->mlock);
+
+    if (dev->keyPending && g_get_monotonic_time () - dev->lastKeyframe >=
+        KEYFRAME_MIN_GAP_MS * 1000) {
+      guint count;
+
+      dev->lastKeyframe = g_get_monotonic_time ();
+      dev->keyPending = FALSE;
+      count = ++dev->keyCount;
+      g_mutex_unlock (&dev->mlock);
+      send_keyframe_request (dev, count);
+      g_mutex_lock (&dev->mlock);
+    }
+  }
+  g_mutex_unlock (&dev->mlock);
+
+  return NULL;
+}
+
 static void
 pad_added_cb (GstElement* element, GstPad* pad, GstElement* ele)
 {
@@ -79,30 +937,165 @@ pad_added_cb (GstElement* element, GstPad* pad, GstElement* ele)
   g_free(name);
 }
 
+static guint64
+thread_cpu_us (clockid_t clock)
+{
+  struct timespec ts;
+
+  if (clock_gettime (clock, &ts) != 0)
+    return 0;
+
+  return (guint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Pool threads move between sessions, so only the CPU time spent between
+ * a task entering and leaving a thread is put on this session's bill.
+ * Called from the streaming thread itself. */
+static void
+track_thread (GstSource *dev, gboolean enter)
+{
+  StreamThread t;
+  guint i;
+
+  g_mutex_lock (&dev->mlock);
+  if (enter) {
+    t.thread = pthread_self ();
+    if (pthread_getcpuclockid (t.thread, &t.clock) == 0) {
+      t.start = thread_cpu_us (t.clock);
+      g_array_append_val (dev->threads, t);
+    }
+  } else {
+    for (i = 0; i < dev->threads->len; i++) {
+      StreamThread *s = &g_array_index (dev->threads, StreamThread, i);
+
+      if (pthread_equal (s->thread, pthread_self ())) {
+        dev->cpuDone += thread_cpu_us (s->clock) - s->start;
+        g_array_remove_index_fast (dev->threads, i);
+        break;
+      }
+    }
+  }
+  g_mutex_unlock (&dev->mlock);
+}
+
+/* Hands every streaming thread of the pipeline to the session's core */
+static GstBusSyncReply
+stream_status_cb (GstBus *bus, GstMessage *msg, gpointer data)
+{
+  GstSource *dev = data;
+  GstStreamStatusType type;
+  GstElement *owner;
+  const GValue *val;
+
+  if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_STREAM_STATUS)
+    return GST_BUS_PASS;
+
+  gst_message_parse_stream_status (msg, &type, &owner);
+  val = gst_message_get_stream_status_object (msg);
+  if (type == GST_STREAM_STATUS_TYPE_CREATE && val &&
+      G_VALUE_TYPE (val) == GST_TYPE_TASK) {
+    /* elements with a core of their own, see add_mosaic_tiles */
+    GstTaskPool *pool = g_object_get_data (G_OBJECT (owner), "task-pool");
+
+    gst_task_set_pool (GST_TASK (g_value_get_object (val)),
+        pool ? pool : dev->pool);
+  }
+  else if (type == GST_STREAM_STATUS_TYPE_ENTER)
+    track_thread (dev, TRUE);
+  else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+    track_thread (dev, FALSE);
+
+  return GST_BUS_PASS;
+}
+
+static GstReader*
+reader_new (GstSource *p, gboolean live)
+{
+  GstReader *r;
+
+  if (!p)
+    return NULL;
+
+  r = g_slice_new0 (GstReader);
+  g_queue_init (&r->fragments);
+  r->needHeader = TRUE;
+  r->live = r->waitKey = live;
+  r->src = p;
+  g_atomic_int_inc (&p->ref);
+
+  g_mutex_lock (&p->dlock);
+  p->readers = g_list_append (p->readers, r);
+  g_mutex_unlock (&p->dlock);
+
+  /* the first frame let through again is the keyframe asked for here */
+  if (g_atomic_int_compare_and_exchange (&p->idle, 1, 0))
+    g_print ("reader attached, resuming\n");
+  request_keyframe (p, "reader attached");
+
+  return r;
+}
+
+GstReader*
+attachReader (GstSource *p)
+{
+  return reader_new (p, FALSE);
+}
+
+/* a reader taking whole fragments as they come, see readFragment */
+GstReader*
+attachLiveReader (GstSource *p)
+{
+  return reader_new (p, TRUE);
+}
+
+void
+detachReader (GstReader *r)
+{
+  GstSource *dev;
+
+  if (!r)
+    return;
+
+  dev = r->src;
+  g_mutex_lock (&dev->dlock);
+  dev->readers = g_list_remove (dev->readers, r);
+  g_queue_free_full (&r->fragments, (GDestroyNotify) gst_buffer_unref);
+  g_mutex_unlock (&dev->dlock);
+
+  g_slice_free (GstReader, r);
+  source_unref (dev);
+}
+
 int
-getData (GstSource *p, char* fTo, int fMaxSize)
+readData (GstReader *r, char* fTo, int fMaxSize)
 {
-  int avail = 0, ret = 0, try = 0;
-  GstSource* dev = p;
+  int ret = 0;
+  GstSource* dev = r->src;
+  gint64 deadline = g_get_monotonic_time () + READER_WAIT_MS * 1000;
 
   g_mutex_lock (&dev->dlock);
 
-  do {
-    avail = (int)gst_adapter_available (dev->adapter);
-    if (avail == 0) {
-      g_mutex_unlock (&dev->dlock);
-      g_usleep (50000);
-      g_mutex_lock (&dev->dlock);
-    }
-  } while (avail == 0 && try++ < 10);
+  while (g_queue_is_empty (&r->fragments) &&
+      g_cond_wait_until (&dev->dcond, &dev->dlock, deadline))
+    ;
 
-  if (avail) {
-    if (avail > fMaxSize) {
-      avail = fMaxSize;
+  while (ret < fMaxSize && !g_queue_is_empty (&r->fragments)) {
+    GstBuffer *frag = g_queue_peek_head (&r->fragments);
+    gsize n = gst_buffer_get_size (frag) - r->offset;
+
+    if (n > (gsize)(fMaxSize - ret))
+      n = fMaxSize - ret;
+
+    gst_buffer_extract (frag, r->offset, fTo + ret, n);
+    r->offset += n;
+    r->queued -= n;
+    r->drained += n;
+    ret += n;
+
+    if (r->offset == gst_buffer_get_size (frag)) {
+      gst_buffer_unref (g_queue_pop_head (&r->fragments));
+      r->offset = 0;
     }
-    gst_adapter_copy (dev->adapter, fTo, 0, avail);
-    gst_adapter_flush(dev->adapter, avail);
-    ret = avail; 
   }
 
   g_mutex_unlock (&dev->dlock);
@@ -110,49 +1103,622 @@ getData (GstSource *p, char* fTo, int fMaxSize)
   return ret;
 }
 
+/* Copies out the next whole fragment, the header counting as one, waiting
+ * up to timeoutMs for it. Returns 0 if none came, or minus the fragment's
+ * size, leaving it queued, if it does not fit. */
+int
+readFragment (GstReader *r, char* fTo, int fMaxSize, int timeoutMs)
+{
+  GstSource* dev = r->src;
+  gint64 deadline = g_get_monotonic_time () + timeoutMs * 1000;
+  GstBuffer *frag;
+  int ret;
+
+  g_mutex_lock (&dev->dlock);
+
+  while (g_queue_is_empty (&r->fragments) &&
+      g_cond_wait_until (&dev->dcond, &dev->dlock, deadline))
+    ;
+
+  frag = g_queue_peek_head (&r->fragments);
+  if (!frag) {
+    ret = 0;
+  } else if (gst_buffer_get_size (frag) > (gsize) fMaxSize) {
+    ret = -(int) gst_buffer_get_size (frag);
+  } else {
+    ret = gst_buffer_extract (frag, 0, fTo, fMaxSize);
+    r->queued -= ret;
+    r->drained += ret;
+    gst_buffer_unref (g_queue_pop_head (&r->fragments));
+  }
+
+  g_mutex_unlock (&dev->dlock);
+
+  return ret;
+}
+
+int
+addRenderer (GstSource *p, char *device)
+{
+  guint i;
+  int started;
+  gchar *info;
+
+  /* the stream is already encoded, the newcomer has to cope with it */
+  info = up_sink_protocol_info (device);
+  if (!profile_supported (p->profile, info)) {
+    g_print ("%s cannot play %s\n", device, p->profile->name);
+    g_free (info);
+    return -1;
+  }
+  g_free (info);
+
+  g_mutex_lock (&p->dlock);
+  for (i = 0; i < p->devices->len; i++) {
+    if (!strcmp (g_ptr_array_index (p->devices, i), device)) {
+      g_mutex_unlock (&p->dlock);
+      return -1;
+    }
+  }
+  g_ptr_array_add (p->devices, g_strdup (device));
+  started = p->bufferCount > 0;
+  g_mutex_unlock (&p->dlock);
+
+  /* joining a running stream, the group start already went out */
+  if (started) {
+    up_play (device, p->url, p->profile->name);
+    request_keyframe (p, "renderer joined");
+  }
+
+  return 0;
+}
+
+void
+holdSource (GstSource *p)
+{
+  g_atomic_int_inc (&p->ref);
+}
+
+void
+releaseSource (GstSource *p)
+{
+  source_unref (p);
+}
+
+/* hands each RTP packet of the multicast branch to its sender thread */
+static GstFlowReturn
+rtp_sample_cb (GstAppSink *sink, gpointer data)
+{
+  GstSource *dev = data;
+  GstSample *sample = gst_app_sink_pull_sample (sink);
+
+  if (!sample)
+    return GST_FLOW_EOS;
+
+  mcast_sender_push (dev->mcast, gst_buffer_ref (gst_sample_get_buffer (sample)));
+  gst_sample_unref (sample);
+
+  return GST_FLOW_OK;
+}
+
+/* the SDP a receiver of the multicast output needs, the parameter sets in
+ * it are only known once the encoder produced its first frame */
+int
+getSdp (GstSource *p, char **sdp)
+{
+  GstCaps *caps;
+  GstPad *pad;
+
+  if (!p || !p->pay)
+    return -1;
+
+  pad = gst_element_get_static_pad (p->pay, "src");
+  caps = gst_pad_get_current_caps (pad);
+  gst_object_unref (pad);
+  if (!caps)
+    return -1;
+
+  *sdp = mcast_sdp (caps, p->mcastIface, p->mcastGroup, p->mcastPort, p->mcastTtl);
+  gst_caps_unref (caps);
+
+  return *sdp ? 0 : -1;
+}
+
+/* the memfd of the session's shared memory ring, -1 if it has none */
+int
+getShmFd (GstSource *p)
+{
+  return p ? shm_ring_fd (p->shm) : -1;
+}
+
+/* JPEG of the most recent frame at output size, ahead of the encoder */
+int
+getSnapshot (GstSource *p, int quality, char **data, int *size)
+{
+  gint64 deadline = g_get_monotonic_time () + SNAPSHOT_WAIT_MS * 1000;
+  GstBuffer *buf = NULL;
+  GstCaps *caps = NULL;
+  unsigned long len = 0;
+
+  if (!p)
+    return -1;
+
+  g_mutex_lock (&p->slock);
+  g_atomic_int_inc (&p->snapWanted);
+  while (!p->snapFrame &&
+      g_cond_wait_until (&p->scond, &p->slock, deadline))
+    ;
+  if (p->snapFrame) {
+    buf = gst_buffer_ref (p->snapFrame);
+    caps = p->snapCaps ? gst_caps_ref (p->snapCaps) : NULL;
+  }
+  if (g_atomic_int_dec_and_test (&p->snapWanted)) {
+    gst_buffer_replace (&p->snapFrame, NULL);
+    gst_caps_replace (&p->snapCaps, NULL);
+  }
+  g_mutex_unlock (&p->slock);
+
+  if (!buf)
+    return -1;
+
+  *data = (char*) snapshot_encode (buf, caps, quality, &len);
+  *size = len;
+  gst_buffer_unref (buf);
+  if (caps)
+    gst_caps_unref (caps);
+
+  return *data ? 0 : -1;
+}
+
+int
+getStats (GstSource *p, struct SourceStats *s)
+{
+  guint i;
+
+  if (!p)
+    return -1;
+
+  g_mutex_lock (&p->mlock);
+  *s = p->stats;
+  s->CpuTimeUs = p->cpuDone;
+  for (i = 0; i < p->threads->len; i++) {
+    StreamThread *t = &g_array_index (p->threads, StreamThread, i);
+
+    s->CpuTimeUs += thread_cpu_us (t->clock) - t->start;
+  }
+  g_mutex_unlock (&p->mlock);
+
+  s->ShedLevel = p->shed;
+  s->Decimate = MAX (p->decimate, MAX (p->shedDecimate, 1));
+  s->Bitrate = p->bitrate;
+  s->QueueOverruns = g_atomic_int_get (&p->overruns);
+  s->EncoderRestarts = g_atomic_int_get (&p->restarts);
+  s->StaticSkipped = g_atomic_int_get (&p->staticSkipped);
+  s->Suspended = g_atomic_int_get (&p->idle);
+  s->IngestDropped = ingest_dropped (p->ingest);
+  {
+    guint64 live, peak, reserved;
+
+    arena_stats (p->arena, &live, &peak, &reserved);
+    s->ArenaLiveBytes = live;
+    s->ArenaPeakBytes = peak;
+    s->ArenaReservedBytes = reserved;
+  }
+
+  return 0;
+}
+
+const char*
+getContentFeatures (GstSource *p)
+{
+  return p->features;
+}
+
+static const StreamProfile*
+select_profile (GPtrArray *devices, int max_pixels)
+{
+  const StreamProfile *profile;
+  char **infos;
+  guint i;
+
+  infos = g_new0 (char*, devices->len + 1);
+  for (i = 0; i < devices->len; i++)
+    infos[i] = up_sink_protocol_info (g_ptr_array_index (devices, i));
+
+  profile = profile_select (infos, devices->len, max_pixels);
+  g_strfreev (infos);
+
+  return profile;
+}
+
+int
+removeRenderer (GstSource *p, char *device)
+{
+  guint i;
+
+  g_mutex_lock (&p->dlock);
+  for (i = 0; i < p->devices->len; i++) {
+    if (!strcmp (g_ptr_array_index (p->devices, i), device)) {
+      g_ptr_array_remove_index (p->devices, i);
+      g_mutex_unlock (&p->dlock);
+      up_stop (device);
+      return 0;
+    }
+  }
+  g_mutex_unlock (&p->dlock);
+
+  return -1;
+}
+
+/* Formats x264enc eats directly, in order of preference. A camera that
+ * can produce one of them needs no conversion at all. */
+static const gchar *encoder_formats[] = { "I420", "NV12", NULL };
+
+static const gchar*
+camera_native_format (void)
+{
+  static gsize probed = 0;
+  static const gchar *native = NULL;
+
+  if (g_once_init_enter (&probed)) {
+    GstElement *probe;
+
+    /* admission may ask before any pipeline was started */
+    initMedia ();
+    probe = make_element ("v4l2src");
+
+    if (probe && gst_element_set_state (probe, GST_STATE_READY) !=
+        GST_STATE_CHANGE_FAILURE) {
+      GstPad *pad = gst_element_get_static_pad (probe, "src");
+      GstCaps *caps = gst_pad_query_caps (pad, NULL);
+      int i;
+
+      for (i = 0; encoder_formats[i] && !native; i++) {
+        GstCaps *want = gst_caps_new_simple ("video/x-raw",
+            "format", G_TYPE_STRING, encoder_formats[i], NULL);
+        if (gst_caps_can_intersect (caps, want))
+          native = encoder_formats[i];
+        gst_caps_unref (want);
+      }
+
+      gst_caps_unref (caps);
+      gst_object_unref (pad);
+      gst_element_set_state (probe, GST_STATE_NULL);
+    }
+    if (probe)
+      gst_object_unref (probe);
+
+    g_print ("camera native encoder format: %s\n", native ? native : "none");
+    g_once_init_leave (&probed, 1);
+  }
+
+  return native;
+}
+
+static void
+set_threads (GstElement *ele, int threads)
+{
+  /* n-threads only exists on newer videoscale/videoconvert */
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (ele), "n-threads"))
+    g_object_set (G_OBJECT (ele), "n-threads", threads, NULL);
+}
+
+static GstElement*
+make_scaler (ScaleMode mode, int threads)
+{
+  GstElement *vscale = make_element ("videoscale");
+  /* nearest, bilinear, 4-tap */
+  static const int methods[] = { 0, 1, 2 };
+
+  if (mode < SCALE_FAST || mode > SCALE_QUALITY)
+    mode = SCALE_BALANCED;
+
+  g_object_set (G_OBJECT (vscale), "method", methods[mode],
+      "add-borders", TRUE, NULL);
+  set_threads (vscale, threads);
+
+  return vscale;
+}
+
+static GstElement*
+make_converter (void)
+{
+  GstElement *vconv = make_element ("videoconvert");
+
+  /* no dithering and no chroma resampling keeps packed 4:2:2 to I420 on
+   * videoconvert's orc (SIMD) line converters */
+  g_object_set (G_OBJECT (vconv), "dither", 0, "chroma-mode", 3, NULL);
+
+  return vconv;
+}
+
+/* Lays the cameras out on a grid in the compositor. Each one is scaled
+ * to its tile size and converted in its own streaming thread, placed on
+ * a core of its own rather than the session's, so the tiles are scaled
+ * in parallel and only once, and the compositor just copies tile sized
+ * frames into place. A tile that falls behind drops its frames instead
+ * of holding the others back. */
+static int
+add_mosaic_tiles (GstSource *dev, GstElement *mixer, const char *sources,
+    ScaleMode mode)
+{
+  gchar **paths = g_strsplit (sources ? sources : "", ",", -1);
+  guint n = 0, i, cols = 1, rows, tw, th, x0, y0;
+  GstCaps *caps;
+  gchar **p;
+
+  for (p = paths; *p; p++) {
+    if (**p)
+      n++;
+  }
+  if (n == 0 || n > MOSAIC_MAX_TILES) {
+    g_print ("mosaic needs 1 to %d sources, got %u\n", MOSAIC_MAX_TILES, n);
+    g_strfreev (paths);
+    return -1;
+  }
+
+  while (cols * cols < n)
+    cols++;
+  rows = (n + cols - 1) / cols;
+  tw = (dev->profile->width / cols) & ~1;
+  th = (dev->profile->height / rows) & ~1;
+  x0 = (dev->profile->width - cols * tw) / 2;
+  y0 = (dev->profile->height - rows * th) / 2;
+  caps = gst_caps_new_simple ("video/x-raw",
+      "format", G_TYPE_STRING, "I420",
+      "width", G_TYPE_INT, tw,
+      "height", G_TYPE_INT, th,
+      "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+      NULL);
+
+  for (p = paths, i = 0; *p; p++) {
+    GstElement *src, *scale, *conv, *size, *que;
+    GstTaskPool *pool;
+    GstPad *srcpad, *sinkpad;
+
+    if (!**p)
+      continue;
+
+    src = make_element ("v4l2src");
+    scale = make_scaler (mode, 1);
+    conv = make_converter ();
+    size = make_element ("capsfilter");
+    que = make_element ("queue");
+    g_object_set (G_OBJECT (src), "device", *p, "io-mode", 2, NULL);
+    g_object_set (G_OBJECT (size), "caps", caps, NULL);
+    g_object_set (G_OBJECT (que), "max-size-time", (guint64)0,
+        "max-size-bytes", 0, "max-size-buffers", 2, "leaky", 2, NULL);
+
+    /* both streaming threads of the tile, capture to scale to convert
+     * and queue to compositor, picked up by stream_status_cb */
+    pool = task_pool_get (task_pool_next_cpu ());
+    g_object_set_data_full (G_OBJECT (src), "task-pool",
+        gst_object_ref (pool), gst_object_unref);
+    g_object_set_data_full (G_OBJECT (que), "task-pool", pool,
+        gst_object_unref);
+
+    gst_bin_add_many (dev->bin, src, scale, conv, size, que, NULL);
+    gst_element_link_many (src, scale, conv, size, que, NULL);
+
+    srcpad = gst_element_get_static_pad (que, "src");
+    sinkpad = gst_element_get_request_pad (mixer, "sink_%u");
+    g_object_set (G_OBJECT (sinkpad),
+        "xpos", x0 + (i % cols) * tw, "ypos", y0 + (i / cols) * th, NULL);
+    gst_pad_link (srcpad, sinkpad);
+    gst_object_unref (sinkpad);
+    gst_object_unref (srcpad);
+
+    /* suspended sessions do not scale their tiles either */
+    sinkpad = gst_element_get_static_pad (scale, "sink");
+    gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, idle_cb, dev, NULL);
+    gst_object_unref (sinkpad);
+    i++;
+  }
+  gst_caps_unref (caps);
+  g_strfreev (paths);
+
+  g_print ("mosaic of %u cameras, %ux%u tiles of %ux%u\n", n, cols, rows,
+      tw, th);
+
+  return 0;
+}
+
+/* What a session for these renderers would run at, for the admission
+ * control to put a price on before anything is started */
+int
+estimateSession (char *devices, char *type, int maxPixels,
+    struct SessionEstimate *e)
+{
+  const StreamProfile *profile;
+  GPtrArray *devs = g_ptr_array_new_with_free_func (g_free);
+  gchar **udns, **u;
+
+  udns = g_strsplit (devices, ",", -1);
+  for (u = udns; *u; u++) {
+    if (**u)
+      g_ptr_array_add (devs, g_strdup (*u));
+  }
+  g_strfreev (udns);
+  profile = select_profile (devs, maxPixels);
+  g_ptr_array_free (devs, TRUE);
+
+  memset (e, 0, sizeof (*e));
+  e->Width = profile->width;
+  e->Height = profile->height;
+  e->Fps = GST_SECOND / FRAME_DURATION;
+  e->Preset = ENCODER_PRESET;
+  if (!strcmp (type, "camera"))
+    e->Passthrough = camera_native_format () != NULL;
+  else if (!strcmp (type, "streaming"))
+    e->Decode = 1;
+  else if (strcmp (type, "mosaic"))
+    return -1;
+  g_strlcpy (e->Profile, profile->name, sizeof (e->Profile));
+
+  return 0;
+}
+
 GstSource*
-startPipeline  (int port, char *device, char *type, char *url, int *ret)
+startPipeline  (int port, char *devices, char *type, char *url,
+    struct SourceConfig *cfg, int *ret)
 {
   GstPad* srcpad, *sinkpad;
-  GstElement* vsrc, *vque, *vdec=NULL, *idv;
+  GstElement* vsrc, *vque, *vdec=NULL, *vscale, *vsize;
+  GstCaps* caps;
+  int threads, active;
   GstBin *bin;
   GstSource *dev;
+  gchar **udns, **u;
 
-  gst_init (NULL, NULL);
+  initMedia ();
 
   dev = calloc (1, sizeof (GstSource));
+  dev->ref = 1;
   dev->bin = bin = (GstBin*)gst_pipeline_new (NULL);
   g_mutex_init (&dev->dlock);
+  g_cond_init (&dev->dcond);
   dev->adapter = gst_adapter_new();
   dev->bufferCount = 0;
-  dev->device = g_strdup (device);
+  dev->devices = g_ptr_array_new_with_free_func (g_free);
+  udns = g_strsplit (devices, ",", -1);
+  for (u = udns; *u; u++) {
+    if (**u)
+      g_ptr_array_add (dev->devices, g_strdup (*u));
+  }
+  g_strfreev (udns);
+  dev->profile = select_profile (dev->devices, cfg->MaxPixels);
+  dev->threads = g_array_new (FALSE, FALSE, sizeof (StreamThread));
+  dev->features = profile_content_features (dev->profile);
   dev->url = g_strdup (url);
+  {
+    /* enough slabs up front for every reader's allowed backlog */
+    guint slabs = (guint) ((gsize) dev->profile->bitrate *
+        READER_MAX_BACKLOG_MS / 8 / ARENA_SLAB_SIZE) + 2;
+
+    dev->arena = arena_new (ARENA_SLAB_SIZE, slabs, slabs * ARENA_MAX_GROWTH);
+  }
+
+  g_print ("streaming %s (%dx%d %s@%s)\n", dev->profile->name,
+      dev->profile->width, dev->profile->height,
+      dev->profile->h264_profile, dev->profile->level);
   dev->lTime = GST_CLOCK_TIME_NONE;
+  dev->lPts = GST_CLOCK_TIME_NONE;
+  g_mutex_init (&dev->mlock);
+  g_cond_init (&dev->mcond);
+  g_mutex_init (&dev->slock);
+  g_cond_init (&dev->scond);
+  dev->bitrate = dev->profile->bitrate;
+  dev->decimate = 1;
+  dev->staticThreshold = cfg->StaticThreshold == 0 ? STATIC_THRESHOLD :
+      MAX (cfg->StaticThreshold, 0);
+  dev->staticKeepAlive = (cfg->StaticKeepAlive > 0 ? cfg->StaticKeepAlive :
+      STATIC_KEEPALIVE_MS) * GST_MSECOND;
+  dev->staticLast = GST_CLOCK_TIME_NONE;
+  if (cfg->Shm) {
+    gchar *name = g_strdup_printf ("vfstream-%d", port);
+
+    dev->shm = shm_ring_new (name, (gsize) dev->profile->bitrate * 1000 / 8 *
+        SHM_RING_SECONDS, SHM_RING_SLOTS);
+    g_free (name);
+    if (!dev->shm)
+      *ret = -1;
+  }
+
+  /* helper threads of the scaler and converter are not shared, split
+   * the cores between the running sessions instead of oversubscribing */
+  active = g_atomic_int_add (&sessions, 1) + 1;
+  threads = cfg->ScaleThreads > 0 ? cfg->ScaleThreads :
+      CLAMP ((int) g_get_num_processors () / active, 1, 4);
 
-  GstElement* vconv = gst_element_factory_make ("videoconvert", NULL);
-  GstElement* venc = gst_element_factory_make ("x264enc", NULL);
-  GstElement* vid = gst_element_factory_make ("identity", NULL);
-  GstElement* vmux = gst_element_factory_make ("qtmux", NULL);
-  GstElement* fsink = gst_element_factory_make ("fakesink", NULL);
+  dev->cpu = cfg->Cpu >= 0 ? cfg->Cpu : task_pool_next_cpu ();
+  dev->pool = task_pool_get (dev->cpu);
+  {
+    GstBus *bus = gst_pipeline_get_bus (GST_PIPELINE (bin));
+
+    gst_bus_set_sync_handler (bus, stream_status_cb, dev, NULL);
+    gst_object_unref (bus);
+  }
+
+  /* everything from here on only ever sees output sized frames: scale
+   * first, letterboxed to the profile's size at square pixels */
+  vscale = make_scaler (cfg->ScaleMode, threads);
+  vsize = dev->vsize = make_element ("capsfilter");
+  caps = gst_caps_new_simple ("video/x-raw",
+      "width", G_TYPE_INT, dev->profile->width,
+      "height", G_TYPE_INT, dev->profile->height,
+      "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+      NULL);
+  g_object_set (G_OBJECT (vsize), "caps", caps, NULL);
+  gst_caps_unref (caps);
+
+  GstElement* vconv;
+  GstElement* venc = dev->venc = make_element ("x264enc");
+  GstElement* vid = make_element ("identity");
+  GstElement* vmux = make_element (dev->profile->mux);
+  GstElement* fsink = make_element ("fakesink");
 
   if (!strcmp(type, "camera")) {  
-    vsrc = gst_element_factory_make ("v4l2src", NULL);
-    vque = gst_element_factory_make ("queue", NULL);
-    g_object_set (G_OBJECT(vsrc), "io-mode", 2, NULL);
-    g_object_set (G_OBJECT(vque), "max-size-time", (guint64)0, "max-size-bytes", 0, "max-size-buffers", 16, NULL);
+    const gchar *native = camera_native_format ();
+
+    vsrc = make_element ("v4l2src");
+    vque = make_element ("queue");
+    if (native) {
+      /* the driver buffers go to the encoder as they are: export them
+       * as dmabufs and only pin the format, nothing gets converted */
+      GstCaps* fcaps = gst_caps_new_simple ("video/x-raw",
+          "format", G_TYPE_STRING, native, NULL);
+      vconv = make_element ("capsfilter");
+      g_object_set (G_OBJECT(vconv), "caps", fcaps, NULL);
+      gst_caps_unref (fcaps);
+      g_object_set (G_OBJECT(vsrc), "io-mode", 4, NULL);
+    } else {
+      vconv = make_converter ();
+      set_threads (vconv, threads);
+      g_object_set (G_OBJECT(vsrc), "io-mode", 2, NULL);
+    }
+    /* v4l2src only hands out its own buffers while the pool has some to
+     * spare, holding more than a couple downstream makes it copy */
+    g_object_set (G_OBJECT(vque), "max-size-time", (guint64)0, "max-size-bytes", 0, "max-size-buffers", 2, NULL);
+    dev->lqueue = vque;
   } else if (!strcmp(type, "streaming")) {
-    vsrc = gst_element_factory_make ("udpsrc", NULL);
-    idv = gst_element_factory_make ("capsfilter", NULL); 
-    vque = gst_element_factory_make ("rtpbin", NULL); 
-    vdec = gst_element_factory_make ("decodebin", NULL);
+    vconv = make_converter ();
+    set_threads (vconv, threads);
+    vsrc = make_element ("appsrc");
+    vque = make_element ("rtpbin"); 
+    vdec = make_element ("decodebin");
+    dev->lqueue = make_element ("queue");
+    g_object_set (G_OBJECT(dev->lqueue), "max-size-time", (guint64)0, "max-size-bytes", 0, "max-size-buffers", 3, NULL);
+  } else if (!strcmp(type, "mosaic")) {
+    /* the tiles come in at their final size, the scaler and converter
+     * after the compositor are passthrough */
+    vconv = make_converter ();
+    vsrc = make_element ("compositor");
+    vque = make_element ("queue");
+    g_object_set (G_OBJECT(vsrc), "background", 1, NULL);
+    g_object_set (G_OBJECT(vque), "max-size-time", (guint64)0, "max-size-bytes", 0, "max-size-buffers", 2, NULL);
+    dev->lqueue = vque;
   }
+  g_signal_connect (G_OBJECT (dev->lqueue), "overrun",
+      G_CALLBACK (overrun_cb), dev);
  
-  gst_bin_add_many (GST_BIN(bin), vsrc, vque, vconv, venc, vid, vmux, fsink, NULL);
+  gst_bin_add_many (GST_BIN(bin), vsrc, vque, vscale, vconv, vsize, venc, vid, vmux, fsink, NULL);
   if (vdec) {
-    gst_bin_add_many (GST_BIN (bin), idv, vdec, NULL);
+    gst_bin_add_many (GST_BIN (bin), vdec, dev->lqueue, NULL);
   } 
   
-  g_object_set (G_OBJECT(venc), "threads", 1, "cabac", FALSE, "tune", 4, NULL);
+  {
+    /* the parameter sets have to survive a switch to the shedding preset,
+     * qtmux takes no new codec_data mid-stream: pin what presets change */
+    gchar *opts = g_strdup_printf ("level=%s:weightp=0", dev->profile->level);
+    g_object_set (G_OBJECT(venc), "threads", 1, "tune", 4,
+        "speed-preset", ENCODER_PRESET, "ref", 1,
+        "dct8x8", strcmp (dev->profile->h264_profile, "high") == 0,
+        "key-int-max", cfg->KeyframeInterval > 0 ? cfg->KeyframeInterval :
+            KEYFRAME_INTERVAL,
+        "cabac", strcmp (dev->profile->h264_profile, "constrained-baseline") != 0,
+        "bitrate", dev->profile->bitrate, "option-string", opts, NULL);
+    g_free (opts);
+  }
   g_object_set (G_OBJECT(vmux), "streamable", TRUE, "fragment-duration", 100, NULL);
   g_object_set( G_OBJECT( fsink ), "sync", FALSE,
       "enable-last-sample", FALSE, "signal-handoffs", TRUE, NULL );
@@ -160,54 +1726,129 @@ startPipeline  (int port, char *device, char *type, char *url, int *ret)
       frame_handoff_cb, dev);
 
   if (!strcmp(type, "camera")) {
-    gst_element_link_many (vsrc, vque, vconv, NULL);
+    gst_element_link_many (vsrc, vque, vscale, NULL);
+  } else if (!strcmp(type, "mosaic")) {
+    if (add_mosaic_tiles (dev, vsrc, cfg->Sources, cfg->ScaleMode) < 0)
+      *ret = -1;
+    caps = gst_caps_new_simple ("video/x-raw",
+        "width", G_TYPE_INT, dev->profile->width,
+        "height", G_TYPE_INT, dev->profile->height,
+        "framerate", GST_TYPE_FRACTION, 30, 1,
+        NULL);
+    gst_element_link_filtered (vsrc, vque, caps);
+    gst_caps_unref (caps);
+    gst_element_link (vque, vscale);
   } else if (!strcmp(type, "streaming")) {
-    GstCaps* caps = gst_caps_new_simple ("application/x-rtp",
-      "payload", G_TYPE_INT, 96,
-      "encoding-name", G_TYPE_STRING, "H264",
-      "clock-rate", G_TYPE_INT, 90000,
-      "media", G_TYPE_STRING, "video",
-      NULL);
-    g_object_set (G_OBJECT (idv), "caps", caps, NULL);
-    gst_element_link (vsrc, idv);
+    guint32 ssrc = 0;
+
+    caps = ingest_caps_from_sdp (cfg->Sdp, &ssrc);
+    if (!caps)
+      caps = gst_caps_new_simple ("application/x-rtp",
+        "payload", G_TYPE_INT, 96,
+        "encoding-name", G_TYPE_STRING, "H264",
+        "clock-rate", G_TYPE_INT, 90000,
+        "media", G_TYPE_STRING, "video",
+        NULL);
+    /* the ingest workers stamp arrival times and must never block */
+    g_object_set (G_OBJECT (vsrc), "caps", caps, "format", GST_FORMAT_TIME,
+        "is-live", TRUE, "block", FALSE, NULL);
     gst_caps_unref (caps);
-    GstPad* srcpad = gst_element_get_static_pad (idv, "src");  
+    GstPad* srcpad = gst_element_get_static_pad (vsrc, "src");  
     GstPad* sinkpad = gst_element_get_request_pad (vque, "recv_rtp_sink_%u");
     g_print (">>>>>> linking rtpbin udp pad %s\n", gst_pad_link_get_name(gst_pad_link(srcpad, sinkpad)));
     gst_object_unref (srcpad);
     gst_object_unref (sinkpad);
-    g_object_set (G_OBJECT(vque), "latency", 2000, NULL);
-    g_object_set (G_OBJECT(vsrc), "port", port, NULL); 
+    /* a clean network needs little jitter buffering, late packets are
+     * dropped rather than stalling the whole session */
+    g_object_set (G_OBJECT(vque), "latency",
+        cfg->RtpLatency > 0 ? cfg->RtpLatency : RTP_LATENCY_MS,
+        "drop-on-latency", TRUE, NULL);
+    dev->ingest = ingest_open (port, ssrc, vsrc);
+    if (!dev->ingest)
+      *ret = -1;
     g_signal_connect (G_OBJECT (vque), "pad-added",
       G_CALLBACK (pad_added_cb), vdec);
     g_signal_connect (G_OBJECT (vdec), "pad-added",
-      G_CALLBACK (pad_added_cb), vconv);
+      G_CALLBACK (pad_added_cb), dev->lqueue);
+    gst_element_link (dev->lqueue, vscale);
   }
 
-  gst_element_link(vconv, venc);
-  GstCaps* caps = gst_caps_new_simple ("video/x-h264",
-      "width", G_TYPE_INT, 320,
-      "height", G_TYPE_INT, 240,
-      "profile", G_TYPE_STRING, "constrained-baseline", 
+  gst_element_link_many (vscale, vconv, vsize, venc, NULL);
+  caps = gst_caps_new_simple ("video/x-h264",
+      "profile", G_TYPE_STRING, dev->profile->h264_profile, 
       NULL);
   gst_element_link_filtered(venc, vid, caps);
   gst_caps_unref (caps); 
-  srcpad = gst_element_get_static_pad (vid, "src");
+  if (cfg->McastGroup && *cfg->McastGroup) {
+    dev->mcastGroup = g_strdup (cfg->McastGroup);
+    dev->mcastIface = g_strdup (cfg->McastIface);
+    dev->mcastPort = cfg->McastPort > 0 ? cfg->McastPort : 5004;
+    dev->mcastTtl = cfg->McastTtl > 0 ? cfg->McastTtl : MCAST_TTL;
+    dev->mcast = mcast_sender_new (dev->mcastGroup, dev->mcastIface,
+        dev->mcastPort, dev->mcastTtl, cfg->McastRate > 0 ? cfg->McastRate :
+            dev->profile->bitrate * MCAST_PACE_FACTOR);
+    if (!dev->mcast)
+      *ret = -1;
+  }
+
+  if (dev->mcast) {
+    /* the same encoded frames also go out as RTP, split off before the
+     * muxer so the multicast side never waits on a fragment */
+    GstElement *tee = make_element ("tee");
+    GstElement *mque = make_element ("queue");
+    GstElement *msink = make_element ("appsink");
+    GstAppSinkCallbacks callbacks = { NULL, NULL, rtp_sample_cb };
+
+    /* kept beyond the pipeline, the SDP may be asked for any time */
+    dev->pay = gst_object_ref (make_element ("rtph264pay"));
+    g_object_set (G_OBJECT (dev->pay), "config-interval", 1, "pt", 96,
+        "mtu", 1400, NULL);
+    g_object_set (G_OBJECT (mque), "max-size-time", (guint64)0,
+        "max-size-bytes", 0, "max-size-buffers", 30, "leaky", 2, NULL);
+    g_object_set (G_OBJECT (msink), "sync", FALSE, "async", FALSE,
+        "enable-last-sample", FALSE, NULL);
+    gst_app_sink_set_callbacks (GST_APP_SINK (msink), &callbacks, dev, NULL);
+
+    gst_bin_add_many (bin, tee, mque, dev->pay, msink, NULL);
+    gst_element_link (vid, tee);
+    gst_element_link_many (tee, mque, dev->pay, msink, NULL);
+    srcpad = gst_element_get_request_pad (tee, "src_%u");
+  } else {
+    srcpad = gst_element_get_static_pad (vid, "src");
+  }
   sinkpad = gst_element_get_request_pad (vmux, "video_%u");
   g_print (">>>>>>>>>>>>>>>>>>>----->%s\n", gst_pad_link_get_name (gst_pad_link (srcpad, sinkpad)));
   gst_object_unref (sinkpad);
   gst_object_unref (srcpad);
   gst_element_link (vmux, fsink);
 
+  /* a received stream still has to be decoded, its sender cannot be
+   * asked for a keyframe to resume at */
+  sinkpad = gst_element_get_static_pad (dev->lqueue, "sink");
+  gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER, idle_cb, dev, NULL);
+  gst_object_unref (sinkpad);
+
   srcpad = gst_element_get_static_pad (venc, "src");
   gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, probe_cb, dev, NULL);
   gst_object_unref (srcpad); 
 
-  if (gst_element_set_state (GST_ELEMENT(bin), GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+  srcpad = gst_element_get_static_pad (vsize, "src");
+  gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, snapshot_cb, dev, NULL);
+  gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, decimate_cb, dev, NULL);
+  if (dev->staticThreshold > 0)
+    gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, static_cb, dev, NULL);
+  gst_object_unref (srcpad); 
+
+  /* a session missing part of its outputs is torn down by the caller,
+   * never started */
+  if (*ret == -1) {
+    printf ("error in pipeline setup");
+  } else if (gst_element_set_state (GST_ELEMENT(bin), GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
     printf ("error in pipeline setup");
     *ret = -1;
   } else {
     printf ("done with pipeline setup\n");
+    dev->monitor = g_thread_new ("monitor", monitor_thread, dev);
   }
 
   return dev;
@@ -217,23 +1858,42 @@ void
 destroyPipeline (GstSource* p)
 {
   GstSource *dev;
+  guint i;
 
   if (!p)
     return;
 
   dev = p;
+  if (dev->monitor) {
+    g_mutex_lock (&dev->mlock);
+    dev->stopping = TRUE;
+    g_cond_signal (&dev->mcond);
+    g_mutex_unlock (&dev->mlock);
+    g_thread_join (dev->monitor);
+    dev->monitor = NULL;
+  }
+  ingest_close (dev->ingest);
+  dev->ingest = NULL;
   if (dev->bin)
     gst_element_set_state (GST_ELEMENT(dev->bin), GST_STATE_NULL);
-  if (dev->adapter)
-    gst_adapter_clear (dev->adapter);
   if (dev->bin)
     gst_object_unref (dev->bin);
-  g_mutex_clear (&dev->dlock);
-  if (dev->url)
-    g_free (dev->url);
-  if (dev->device) {
-    up_stop (dev->device);
-    g_free (dev->device);
-  }
-  free (dev);
+  dev->bin = NULL;
+  mcast_sender_free (dev->mcast);
+  dev->mcast = NULL;
+  g_mutex_lock (&dev->dlock);
+  shm_ring_free (dev->shm);
+  dev->shm = NULL;
+  g_mutex_unlock (&dev->dlock);
+
+  g_mutex_lock (&dev->dlock);
+  for (i = 0; i < dev->devices->len; i++)
+    up_stop (g_ptr_array_index (dev->devices, i));
+  g_ptr_array_set_size (dev->devices, 0);
+  g_mutex_unlock (&dev->dlock);
+
+  g_atomic_int_add (&sessions, -1);
+
+  /* attached readers keep the source alive until they detach */
+  source_unref (dev);
 }
@@ -10,9 +10,82 @@
 #define _GST_SOURCE_H_
 
 typedef struct GstSource GstSource;
+typedef struct GstReader GstReader;
 
-int getData (GstSource *p, char* fTo, int fMaxSize);
-GstSource* startPipeline  (int port, char *device, char *type, char *url, int *ret);
+typedef enum {
+  SCALE_FAST = 0,
+  SCALE_BALANCED,
+  SCALE_QUALITY
+} ScaleMode;
+
+struct SourceConfig {
+	int ScaleMode;
+	int ScaleThreads;
+	int KeyframeInterval;
+	int RtpLatency;
+	char *Sdp;
+	int Cpu;
+	int StaticThreshold;
+	int StaticKeepAlive;
+	int MaxPixels;
+	char *McastGroup;
+	int McastPort;
+	int McastTtl;
+	int McastRate;
+	char *McastIface;
+	int Shm;
+	char *Sources;
+};
+
+struct SessionEstimate {
+	int Width;
+	int Height;
+	int Fps;
+	int Preset;
+	int Passthrough;
+	int Decode;
+	char Profile[32];
+};
+
+struct SourceStats {
+	int ShedLevel;
+	int EncoderLagMs;
+	int Decimate;
+	int Bitrate;
+	unsigned int LatencyMessages;
+	unsigned int Errors;
+	unsigned int Warnings;
+	unsigned int QueueOverruns;
+	unsigned int LeakyEnabled;
+	unsigned int DecimateSteps;
+	unsigned int PresetDowngrades;
+	unsigned int EncoderRestarts;
+	unsigned int StaticSkipped;
+	unsigned int Suspended;
+	unsigned int Suspends;
+	unsigned int IngestDropped;
+	unsigned long long CpuTimeUs;
+	unsigned long long ArenaLiveBytes;
+	unsigned long long ArenaPeakBytes;
+	unsigned long long ArenaReservedBytes;
+};
+
+GstReader* attachReader (GstSource *p);
+int readData (GstReader *r, char* fTo, int fMaxSize);
+GstReader* attachLiveReader (GstSource *p);
+int readFragment (GstReader *r, char* fTo, int fMaxSize, int timeoutMs);
+void detachReader (GstReader *r);
+int addRenderer (GstSource *p, char *device);
+int removeRenderer (GstSource *p, char *device);
+int getStats (GstSource *p, struct SourceStats *s);
+int estimateSession (char *devices, char *type, int maxPixels, struct SessionEstimate *e);
+int getSnapshot (GstSource *p, int quality, char **data, int *size);
+int getSdp (GstSource *p, char **sdp);
+int getShmFd (GstSource *p);
+void holdSource (GstSource *p);
+void releaseSource (GstSource *p);
+const char* getContentFeatures (GstSource *p);
+GstSource* startPipeline  (int port, char *devices, char *type, char *url, struct SourceConfig *cfg, int *ret);
 void destroyPipeline (GstSource* p);
 
 #endif
@@ -0,0 +1,441 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Shared RTP receive path for all "streaming" sessions.
+ *
+ * One worker thread per core, each with its own epoll set. Every port in
+ * use gets one SO_REUSEPORT socket per worker, so the kernel spreads the
+ * feeds across the workers by flow while packets of one feed stay in
+ * order on one of them. Workers drain their sockets with recvmmsg straight
+ * into GstBuffers recycled through a per worker pool and hand them to the
+ * owning session's appsrc, one buffer list per session and batch. A
+ * session whose appsrc already holds INGEST_MAX_BYTES loses the batch.
+ */
+
+#define _GNU_SOURCE
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/sdp/gstsdpmessage.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "Ingest.h"
+#include "TaskPool.h"
+
+#define INGEST_BATCH      32
+#define INGEST_MTU        1500
+#define INGEST_RCVBUF     (4 * 1024 * 1024)
+#define INGEST_EVENTS     16
+#define INGEST_MAX_BYTES  (2 * 1024 * 1024)
+
+typedef struct
+{
+  int port;
+  int *fds;
+  GList *streams;
+} IngestPort;
+
+struct IngestStream
+{
+  IngestPort *port;
+  volatile gint ssrc;     /* 0 until the first sender is locked onto */
+  gint pt;                /* payload type from the caps, -1 for any */
+  GstElement *appsrc;
+  GstBufferList *batch;
+  GstClockTime now;
+  volatile gint dropped;  /* packets lost to a full appsrc */
+};
+
+typedef struct
+{
+  int epfd;
+  GThread *thread;
+  GstBufferPool *pool;
+  GstBuffer *bufs[INGEST_BATCH];
+  GstMapInfo maps[INGEST_BATCH];
+} IngestWorker;
+
+static GRWLock ilock;
+static GHashTable *ports;   /* port -> IngestPort */
+static GHashTable *sockets; /* fd -> IngestPort */
+static IngestWorker *workers;
+static guint n_workers;
+
+static void
+worker_refill (IngestWorker *w, int i)
+{
+  if (gst_buffer_pool_acquire_buffer (w->pool, &w->bufs[i], NULL) != GST_FLOW_OK)
+    w->bufs[i] = gst_buffer_new_allocate (NULL, INGEST_MTU, NULL);
+  gst_buffer_map (w->bufs[i], &w->maps[i], GST_MAP_WRITE);
+}
+
+/* Packets go back to the pool once the depayloader is done with them,
+ * sized down to what was received, the pool restores the full MTU. */
+static GstBufferPool*
+worker_pool_new (void)
+{
+  GstBufferPool *pool = gst_buffer_pool_new ();
+  GstStructure *config = gst_buffer_pool_get_config (pool);
+
+  gst_buffer_pool_config_set_params (config, NULL, INGEST_MTU,
+      INGEST_BATCH * 2, 0);
+  gst_buffer_pool_set_config (pool, config);
+  gst_buffer_pool_set_active (pool, TRUE);
+
+  return pool;
+}
+
+/* Workers only hold the read lock, a stream without an SSRC locks onto
+ * the first sender of its payload type with a compare and swap, so one
+ * worker wins and stray packets of another type do not take it over */
+static IngestStream*
+port_find_stream (IngestPort *p, guint32 ssrc, gint pt)
+{
+  GList *l;
+
+  for (l = p->streams; l != NULL; l = l->next) {
+    IngestStream *s = l->data;
+
+    if (ssrc != 0 && (guint32) g_atomic_int_get (&s->ssrc) == ssrc)
+      return s;
+  }
+
+  for (l = p->streams; l != NULL; l = l->next) {
+    IngestStream *s = l->data;
+
+    if ((s->pt < 0 || s->pt == pt) &&
+        g_atomic_int_compare_and_exchange (&s->ssrc, 0, (gint) ssrc)) {
+      g_print ("ingest: port %d locked onto ssrc %08x\n", p->port, ssrc);
+      return s;
+    }
+  }
+
+  return NULL;
+}
+
+/* called with the read lock held */
+static void
+worker_drain (IngestWorker *w, int fd, IngestPort *p)
+{
+  struct mmsghdr msgs[INGEST_BATCH];
+  struct iovec iov[INGEST_BATCH];
+  GList *touched = NULL, *l;
+  GstClock *clock;
+  int i, n;
+
+  for (i = 0; i < INGEST_BATCH; i++) {
+    iov[i].iov_base = w->maps[i].data;
+    iov[i].iov_len = INGEST_MTU;
+    memset (&msgs[i].msg_hdr, 0, sizeof (msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  n = recvmmsg (fd, msgs, INGEST_BATCH, MSG_DONTWAIT, NULL);
+  if (n <= 0)
+    return;
+
+  for (i = 0; i < n; i++) {
+    guint8 *data = w->maps[i].data;
+    guint len = msgs[i].msg_len;
+    IngestStream *s;
+
+    if (len < 12 || (data[0] >> 6) != 2)
+      continue;
+
+    s = port_find_stream (p, GST_READ_UINT32_BE (data + 8), data[1] & 0x7f);
+    if (!s)
+      continue;
+
+    if (!s->batch) {
+      s->batch = gst_buffer_list_new_sized (n);
+      touched = g_list_prepend (touched, s);
+      /* arrival time for the jitterbuffer, one reading per session and
+       * batch, against that session's own base time */
+      s->now = GST_CLOCK_TIME_NONE;
+      if ((clock = gst_element_get_clock (s->appsrc))) {
+        s->now = gst_clock_get_time (clock) -
+            gst_element_get_base_time (s->appsrc);
+        gst_object_unref (clock);
+      }
+    }
+
+    gst_buffer_unmap (w->bufs[i], &w->maps[i]);
+    gst_buffer_set_size (w->bufs[i], len);
+    GST_BUFFER_DTS (w->bufs[i]) = s->now;
+    gst_buffer_list_add (s->batch, w->bufs[i]);
+    worker_refill (w, i);
+  }
+
+  for (l = touched; l != NULL; l = l->next) {
+    IngestStream *s = l->data;
+
+    /* a stalled decoder must not make the queue grow without bound, the
+     * jitterbuffer copes with the gap better than with the latency */
+    if (gst_app_src_get_current_level_bytes (GST_APP_SRC (s->appsrc)) >=
+        INGEST_MAX_BYTES) {
+      g_atomic_int_add (&s->dropped, gst_buffer_list_length (s->batch));
+      gst_buffer_list_unref (s->batch);
+    } else {
+      gst_app_src_push_buffer_list (GST_APP_SRC (s->appsrc), s->batch);
+    }
+    s->batch = NULL;
+  }
+  g_list_free (touched);
+}
+
+static gpointer
+worker_thread (gpointer data)
+{
+  IngestWorker *w = data;
+  struct epoll_event events[INGEST_EVENTS];
+  int i, n;
+
+  task_pool_pin (w - workers);
+  w->pool = worker_pool_new ();
+  for (i = 0; i < INGEST_BATCH; i++)
+    worker_refill (w, i);
+
+  for (;;) {
+    n = epoll_wait (w->epfd, events, INGEST_EVENTS, -1);
+    if (n < 0 && errno != EINTR)
+      break;
+
+    g_rw_lock_reader_lock (&ilock);
+    for (i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      IngestPort *p = g_hash_table_lookup (sockets, GINT_TO_POINTER (fd));
+
+      /* the port may have gone away since epoll_wait returned */
+      if (p)
+        worker_drain (w, fd, p);
+    }
+    g_rw_lock_reader_unlock (&ilock);
+  }
+
+  return NULL;
+}
+
+static void
+ingest_init (void)
+{
+  static gsize initialized = 0;
+  guint i;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  g_rw_lock_init (&ilock);
+  ports = g_hash_table_new (g_direct_hash, g_direct_equal);
+  sockets = g_hash_table_new (g_direct_hash, g_direct_equal);
+  n_workers = g_get_num_processors ();
+  workers = g_new0 (IngestWorker, n_workers);
+
+  for (i = 0; i < n_workers; i++) {
+    gchar *name = g_strdup_printf ("ingest%u", i);
+
+    workers[i].epfd = epoll_create1 (EPOLL_CLOEXEC);
+    workers[i].thread = g_thread_new (name, worker_thread, &workers[i]);
+    g_free (name);
+  }
+
+  g_print ("rtp ingest: %u workers\n", n_workers);
+  g_once_init_leave (&initialized, 1);
+}
+
+static int
+open_socket (int port)
+{
+  struct sockaddr_in addr;
+  int fd, on = 1, rcvbuf = INGEST_RCVBUF;
+
+  fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+  setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  addr.sin_port = htons (port);
+  if (bind (fd, (struct sockaddr*) &addr, sizeof (addr)) < 0) {
+    g_warning ("ingest: bind to %d failed: %s", port, g_strerror (errno));
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+port_free (IngestPort *p)
+{
+  guint i;
+
+  for (i = 0; i < n_workers; i++) {
+    if (p->fds[i] < 0)
+      continue;
+    epoll_ctl (workers[i].epfd, EPOLL_CTL_DEL, p->fds[i], NULL);
+    g_hash_table_remove (sockets, GINT_TO_POINTER (p->fds[i]));
+    close (p->fds[i]);
+  }
+  g_free (p->fds);
+  g_slice_free (IngestPort, p);
+}
+
+static IngestPort*
+port_open (int port)
+{
+  IngestPort *p = g_slice_new0 (IngestPort);
+  guint i;
+
+  p->port = port;
+  p->fds = g_new (int, n_workers);
+  for (i = 0; i < n_workers; i++)
+    p->fds[i] = -1;
+
+  for (i = 0; i < n_workers; i++) {
+    struct epoll_event ev;
+
+    p->fds[i] = open_socket (port);
+    if (p->fds[i] < 0) {
+      port_free (p);
+      return NULL;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = p->fds[i];
+    g_hash_table_insert (sockets, GINT_TO_POINTER (p->fds[i]), p);
+    epoll_ctl (workers[i].epfd, EPOLL_CTL_ADD, p->fds[i], &ev);
+  }
+
+  return p;
+}
+
+IngestStream*
+ingest_open (int port, guint32 ssrc, GstElement *appsrc)
+{
+  IngestStream *s;
+  IngestPort *p;
+  GstCaps *caps = NULL;
+  gint pt = -1;
+
+  ingest_init ();
+
+  g_object_get (G_OBJECT (appsrc), "caps", &caps, NULL);
+  if (caps) {
+    gst_structure_get_int (gst_caps_get_structure (caps, 0), "payload", &pt);
+    gst_caps_unref (caps);
+  }
+
+  g_rw_lock_writer_lock (&ilock);
+  p = g_hash_table_lookup (ports, GINT_TO_POINTER (port));
+  if (!p) {
+    p = port_open (port);
+    if (!p) {
+      g_rw_lock_writer_unlock (&ilock);
+      return NULL;
+    }
+    g_hash_table_insert (ports, GINT_TO_POINTER (port), p);
+  }
+
+  s = g_slice_new0 (IngestStream);
+  s->port = p;
+  s->ssrc = (gint) ssrc;
+  s->pt = pt;
+  s->appsrc = gst_object_ref (appsrc);
+  g_object_set (G_OBJECT (appsrc), "max-bytes", (guint64) INGEST_MAX_BYTES,
+      NULL);
+  p->streams = g_list_append (p->streams, s);
+  g_rw_lock_writer_unlock (&ilock);
+
+  return s;
+}
+
+void
+ingest_close (IngestStream *s)
+{
+  IngestPort *p;
+
+  if (!s)
+    return;
+
+  g_rw_lock_writer_lock (&ilock);
+  p = s->port;
+  p->streams = g_list_remove (p->streams, s);
+  if (!p->streams) {
+    g_hash_table_remove (ports, GINT_TO_POINTER (p->port));
+    port_free (p);
+  }
+  g_rw_lock_writer_unlock (&ilock);
+
+  gst_object_unref (s->appsrc);
+  g_slice_free (IngestStream, s);
+}
+
+guint
+ingest_dropped (IngestStream *s)
+{
+  return s ? g_atomic_int_get (&s->dropped) : 0;
+}
+
+/* RTP caps for the first video stream of an SDP description, plus its
+ * SSRC if the description pins one */
+GstCaps*
+ingest_caps_from_sdp (const char *sdp, guint32 *ssrc)
+{
+  GstSDPMessage *msg;
+  GstCaps *caps = NULL;
+  guint i;
+
+  *ssrc = 0;
+  if (!sdp || !*sdp)
+    return NULL;
+
+  gst_sdp_message_new (&msg);
+  if (gst_sdp_message_parse_buffer ((const guint8*) sdp, strlen (sdp), msg)
+      != GST_SDP_OK)
+    goto done;
+
+  for (i = 0; i < gst_sdp_message_medias_len (msg); i++) {
+    const GstSDPMedia *media = gst_sdp_message_get_media (msg, i);
+    const gchar *val;
+    GstStructure *st;
+
+    if (g_strcmp0 (gst_sdp_media_get_media (media), "video") ||
+        gst_sdp_media_formats_len (media) == 0)
+      continue;
+
+    caps = gst_sdp_media_get_caps_from_media (media,
+        atoi (gst_sdp_media_get_format (media, 0)));
+    if (!caps)
+      continue;
+
+    caps = gst_caps_make_writable (caps);
+    st = gst_caps_get_structure (caps, 0);
+    gst_structure_set_name (st, "application/x-rtp");
+
+    if ((val = gst_sdp_media_get_attribute_val (media, "ssrc")))
+      *ssrc = (guint32) strtoul (val, NULL, 10);
+    break;
+  }
+
+done:
+  gst_sdp_message_free (msg);
+  return caps;
+}
@@ -0,0 +1,21 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __INGEST_H__
+#define __INGEST_H__
+
+#include <gst/gst.h>
+
+typedef struct IngestStream IngestStream;
+
+GstCaps*        ingest_caps_from_sdp (const char*, guint32*);
+IngestStream*   ingest_open (int, guint32, GstElement*);
+void            ingest_close (IngestStream*);
+guint           ingest_dropped (IngestStream*);
+
+#endif
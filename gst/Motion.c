@@ -0,0 +1,82 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Change detection on luma: the frame is cut into 16x16 blocks and it
+ * counts as changed as soon as one block differs by more than the
+ * threshold, on average per pixel, from the reference. Moving scenes
+ * bail out at the first changed block, static ones cost one pass of
+ * PSADBW over the picture.
+ */
+
+#include <glib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Motion.h"
+
+#define BLOCK   16
+
+#ifdef __SSE2__
+static guint
+block_sad (const guint8 *a, int as, const guint8 *b, int bs)
+{
+  __m128i acc = _mm_setzero_si128 ();
+  int y;
+
+  for (y = 0; y < BLOCK; y++)
+    acc = _mm_add_epi64 (acc,
+        _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i*) (a + y * as)),
+          _mm_loadu_si128 ((const __m128i*) (b + y * bs))));
+
+  /* two partial sums, one per 64 bit half */
+  return _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+}
+#else
+static guint
+block_sad (const guint8 *a, int as, const guint8 *b, int bs)
+{
+  guint sad = 0;
+  int x, y;
+
+  for (y = 0; y < BLOCK; y++)
+    for (x = 0; x < BLOCK; x++)
+      sad += ABS ((int) a[y * as + x] - (int) b[y * bs + x]);
+
+  return sad;
+}
+#endif
+
+/* The last row and column of blocks are moved back to end at the frame
+ * edge, overlapping their neighbours, so the rows and columns past the
+ * last whole block are compared too. */
+gboolean
+motion_luma_changed (const guint8 *cur, int cstride, const guint8 *ref,
+    int rstride, int width, int height, guint threshold)
+{
+  guint limit = threshold * BLOCK * BLOCK;
+  int x, y, bx, by;
+
+  /* too small to compare, never take it for static */
+  if (width < BLOCK || height < BLOCK)
+    return TRUE;
+
+  for (y = 0; y < height; y += BLOCK) {
+    by = MIN (y, height - BLOCK);
+    for (x = 0; x < width; x += BLOCK) {
+      bx = MIN (x, width - BLOCK);
+      if (block_sad (cur + by * cstride + bx, cstride,
+            ref + by * rstride + bx, rstride) > limit)
+        return TRUE;
+    }
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,17 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __MOTION_H__
+#define __MOTION_H__
+
+#include <glib.h>
+
+gboolean        motion_luma_changed (const guint8*, int, const guint8*, int,
+                    int, int, guint);
+
+#endif
@@ -0,0 +1,232 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Sends a session's RTP packets to a multicast group. Packets are queued
+ * by the payloader's streaming thread and sent from a thread of their
+ * own, up to MCAST_BATCH at a time with sendmmsg. A token bucket paces
+ * them, so a keyframe goes out spread over a few milliseconds instead of
+ * as one burst the switches have to absorb.
+ */
+
+#define _GNU_SOURCE
+#include <gst/gst.h>
+#include <gst/sdp/gstsdpmessage.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Multicast.h"
+
+#define MCAST_BATCH           32
+#define MCAST_MAX_QUEUED      4096
+#define MCAST_BURST_BYTES     (16 * 1500)
+
+struct McastSender
+{
+  int fd;
+  struct sockaddr_in dest;
+  GAsyncQueue *queue;
+  GThread *thread;
+  volatile gint stopping;
+
+  /* pacing */
+  gdouble bytes_per_us;
+  gdouble tokens;
+  gint64 last;
+};
+
+static void
+pace (McastSender *s, gsize bytes)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  s->tokens = MIN (MCAST_BURST_BYTES, s->tokens + (now - s->last) * s->bytes_per_us);
+  s->last = now;
+
+  if (s->tokens < bytes) {
+    g_usleep ((gulong) ((bytes - s->tokens) / s->bytes_per_us));
+    s->tokens = bytes;
+    s->last = g_get_monotonic_time ();
+  }
+  s->tokens -= bytes;
+}
+
+static gpointer
+sender_thread (gpointer data)
+{
+  McastSender *s = data;
+  struct mmsghdr msgs[MCAST_BATCH];
+  struct iovec iov[MCAST_BATCH];
+  GstMapInfo maps[MCAST_BATCH];
+  GstBuffer *bufs[MCAST_BATCH];
+  gsize bytes;
+  int i, j, k, n, sent;
+
+  while (!g_atomic_int_get (&s->stopping)) {
+    bufs[0] = g_async_queue_timeout_pop (s->queue, 100 * 1000);
+    if (!bufs[0])
+      continue;
+
+    for (n = 1; n < MCAST_BATCH; n++) {
+      bufs[n] = g_async_queue_try_pop (s->queue);
+      if (!bufs[n])
+        break;
+    }
+
+    for (i = 0; i < n; i++) {
+      gst_buffer_map (bufs[i], &maps[i], GST_MAP_READ);
+      iov[i].iov_base = maps[i].data;
+      iov[i].iov_len = maps[i].size;
+      memset (&msgs[i], 0, sizeof (msgs[i]));
+      msgs[i].msg_hdr.msg_name = &s->dest;
+      msgs[i].msg_hdr.msg_namelen = sizeof (s->dest);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* paced in slices no larger than the bucket, a whole batch in one
+     * call would leave as the very burst the pacing is there to avoid */
+    for (i = 0; i < n; i = j) {
+      bytes = maps[i].size;
+      for (j = i + 1; j < n && bytes + maps[j].size <= MCAST_BURST_BYTES; j++)
+        bytes += maps[j].size;
+
+      pace (s, bytes);
+      for (k = i; k < j; k += sent) {
+        sent = sendmmsg (s->fd, &msgs[k], j - k, 0);
+        if (sent < 0 && errno == EINTR) {
+          sent = 0;
+        } else if (sent < 0) {
+          g_warning ("multicast send failed: %s", g_strerror (errno));
+          break;
+        }
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      gst_buffer_unmap (bufs[i], &maps[i]);
+      gst_buffer_unref (bufs[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* rate_kbps is the pace packets leave at, well above the stream's own
+ * bitrate so that only bursts get smoothed. iface is the address of the
+ * interface to send on, the default route's otherwise. */
+McastSender*
+mcast_sender_new (const char *group, const char *iface, int port, int ttl,
+    int rate_kbps)
+{
+  McastSender *s;
+  unsigned char t = ttl;
+  struct in_addr ifaddr;
+  int fd;
+
+  fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return NULL;
+
+  s = g_slice_new0 (McastSender);
+  s->fd = fd;
+  s->dest.sin_family = AF_INET;
+  s->dest.sin_port = htons (port);
+  if (inet_pton (AF_INET, group, &s->dest.sin_addr) != 1 ||
+      !IN_MULTICAST (ntohl (s->dest.sin_addr.s_addr))) {
+    g_warning ("%s is not a multicast group", group);
+    close (fd);
+    g_slice_free (McastSender, s);
+    return NULL;
+  }
+  setsockopt (fd, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof (t));
+  if (iface && *iface) {
+    if (inet_pton (AF_INET, iface, &ifaddr) != 1 ||
+        setsockopt (fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+            sizeof (ifaddr)) < 0)
+      g_warning ("cannot send multicast from %s, using the default route",
+          iface);
+  }
+
+  s->bytes_per_us = rate_kbps * 1000.0 / 8 / G_USEC_PER_SEC;
+  s->tokens = MCAST_BURST_BYTES;
+  s->last = g_get_monotonic_time ();
+  s->queue = g_async_queue_new_full ((GDestroyNotify) gst_buffer_unref);
+  s->thread = g_thread_new ("mcast", sender_thread, s);
+
+  g_print ("multicast to %s:%d ttl %d, paced at %d kbit/s\n", group, port,
+      ttl, rate_kbps);
+
+  return s;
+}
+
+/* takes the buffer */
+void
+mcast_sender_push (McastSender *s, GstBuffer *buf)
+{
+  /* the sender cannot keep up, better lose packets than latency */
+  if (g_async_queue_length (s->queue) > MCAST_MAX_QUEUED) {
+    gst_buffer_unref (buf);
+    return;
+  }
+  g_async_queue_push (s->queue, buf);
+}
+
+void
+mcast_sender_free (McastSender *s)
+{
+  if (!s)
+    return;
+
+  g_atomic_int_set (&s->stopping, 1);
+  g_thread_join (s->thread);
+  g_async_queue_unref (s->queue);
+  close (s->fd);
+  g_slice_free (McastSender, s);
+}
+
+/* a session description for receivers, built from the payloader's caps,
+ * origin is the address the stream is sent from */
+gchar*
+mcast_sdp (GstCaps *caps, const char *origin, const char *group, int port,
+    int ttl)
+{
+  GstSDPMessage *msg;
+  GstSDPMedia *media;
+  gchar *text;
+
+  gst_sdp_message_new (&msg);
+  gst_sdp_message_set_version (msg, "0");
+  gst_sdp_message_set_origin (msg, "-", "0", "1", "IN", "IP4",
+      origin && *origin ? origin : "127.0.0.1");
+  gst_sdp_message_set_session_name (msg, "vfstream");
+  gst_sdp_message_add_time (msg, "0", "0", NULL);
+
+  gst_sdp_media_new (&media);
+  if (gst_sdp_media_set_media_from_caps (caps, media) != GST_SDP_OK) {
+    gst_sdp_media_free (media);
+    gst_sdp_message_free (msg);
+    return NULL;
+  }
+  gst_sdp_media_set_port_info (media, port, 1);
+  gst_sdp_media_set_proto (media, "RTP/AVP");
+  gst_sdp_media_add_connection (media, "IN", "IP4", group, ttl, 1);
+  gst_sdp_message_add_media (msg, media);
+  gst_sdp_media_free (media);
+
+  text = gst_sdp_message_as_text (msg);
+  gst_sdp_message_free (msg);
+
+  return text;
+}
@@ -0,0 +1,21 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __MULTICAST_H__
+#define __MULTICAST_H__
+
+#include <gst/gst.h>
+
+typedef struct McastSender McastSender;
+
+McastSender*    mcast_sender_new (const char*, const char*, int, int, int);
+void            mcast_sender_push (McastSender*, GstBuffer*);
+void            mcast_sender_free (McastSender*);
+gchar*          mcast_sdp (GstCaps*, const char*, const char*, int, int);
+
+#endif
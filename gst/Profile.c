@@ -0,0 +1,134 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#include <libgupnp-av/gupnp-av.h>
+
+#include <string.h>
+
+#include "Profile.h"
+
+/* Ordered from the most efficient to the least demanding, the first
+ * entry every renderer of a session accepts wins. */
+static const StreamProfile profiles[] = {
+  { "AVC_MP4_HP_HD_AAC", "video/mp4", "qtmux",
+    "high", "3.1", 1280, 720, 2500, FALSE },
+  { "AVC_MP4_MP_HD_720p_AAC", "video/mp4", "qtmux",
+    "main", "3.1", 1280, 720, 3000, FALSE },
+  { "AVC_MP4_MP_SD_AAC_MULT5", "video/mp4", "qtmux",
+    "main", "3", 640, 480, 1500, FALSE },
+  { "AVC_MP4_BL_L3L_SD_AAC", "video/mp4", "qtmux",
+    "constrained-baseline", "3", 640, 480, 1500, FALSE },
+  { "AVC_MP4_BL_CIF30_AAC_MULT5", "video/mp4", "qtmux",
+    "constrained-baseline", "1.3", 352, 288, 600, FALSE },
+  { "AVC_MP4_BL_CIF15_AAC_520", "video/mp4", "qtmux",
+    "constrained-baseline", "1.2", 320, 240, 400, TRUE },
+};
+
+#define N_PROFILES G_N_ELEMENTS (profiles)
+#define DEFAULT_PROFILE (N_PROFILES - 1)
+
+const StreamProfile*
+profile_default (void)
+{
+  return &profiles[DEFAULT_PROFILE];
+}
+
+const StreamProfile*
+profile_find (const char *name)
+{
+  guint i;
+
+  for (i = 0; name && i < N_PROFILES; i++) {
+    if (!strcmp (profiles[i].name, name))
+      return &profiles[i];
+  }
+
+  return NULL;
+}
+
+/* Bit i is set when the renderer takes profiles[i]. Entries with a
+ * video/mp4 (or *) mime type but no DLNA.ORG_PN only enable the wildcard
+ * profile, nothing tells us how much such a renderer can decode. */
+static guint
+parse_capabilities (const char *sink_protocol_info)
+{
+  gchar **entries, **e;
+  guint caps = 0, i;
+
+  if (!sink_protocol_info)
+    return 0;
+
+  entries = g_strsplit (sink_protocol_info, ",", -1);
+  for (e = entries; *e; e++) {
+    GUPnPProtocolInfo *info;
+    const char *protocol, *mime, *pn;
+
+    info = gupnp_protocol_info_new_from_string (g_strstrip (*e), NULL);
+    if (!info)
+      continue;
+
+    protocol = gupnp_protocol_info_get_protocol (info);
+    mime = gupnp_protocol_info_get_mime_type (info);
+    pn = gupnp_protocol_info_get_dlna_profile (info);
+
+    if (protocol && mime && !strcmp (protocol, "http-get")) {
+      for (i = 0; i < N_PROFILES; i++) {
+        if (strcmp (mime, "*") && strcmp (mime, profiles[i].mime))
+          continue;
+        if (pn ? !strcmp (pn, profiles[i].name) : profiles[i].wildcard)
+          caps |= 1 << i;
+      }
+    }
+
+    g_object_unref (info);
+  }
+  g_strfreev (entries);
+
+  return caps;
+}
+
+const StreamProfile*
+profile_select (char **sink_protocol_infos, int n, int max_pixels)
+{
+  guint caps = ~0u, i;
+  int j;
+
+  if (n == 0)
+    return profile_default ();
+
+  for (j = 0; j < n; j++) {
+    /* renderer did not tell, stay with what always worked */
+    if (!sink_protocol_infos[j])
+      return profile_default ();
+    caps &= parse_capabilities (sink_protocol_infos[j]);
+  }
+
+  for (i = 0; i < N_PROFILES; i++) {
+    if ((caps & (1 << i)) && (max_pixels <= 0 ||
+          profiles[i].width * profiles[i].height <= max_pixels))
+      return &profiles[i];
+  }
+
+  return profile_default ();
+}
+
+gboolean
+profile_supported (const StreamProfile *p, const char *sink_protocol_info)
+{
+  if (!sink_protocol_info)
+    return p == profile_default ();
+
+  return (parse_capabilities (sink_protocol_info) & (1 << (p - profiles))) != 0;
+}
+
+gchar*
+profile_content_features (const StreamProfile *p)
+{
+  return g_strdup_printf ("DLNA.ORG_PN=%s;DLNA.ORG_OP=00;DLNA.ORG_CI=1;"
+      "DLNA.ORG_FLAGS=05700000000000000000000000000000", p->name);
+}
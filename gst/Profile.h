@@ -0,0 +1,33 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <glib-2.0/glib.h>
+
+typedef struct
+{
+  const char *name;
+  const char *mime;
+  const char *mux;
+  const char *h264_profile;
+  const char *level;
+  int width;
+  int height;
+  int bitrate;
+  gboolean wildcard;
+} StreamProfile;
+
+const StreamProfile*  profile_default (void);
+const StreamProfile*  profile_find (const char*);
+const StreamProfile*  profile_select (char**, int, int);
+gboolean              profile_supported (const StreamProfile*, const char*);
+gchar*                profile_content_features (const StreamProfile*);
+
+#endif
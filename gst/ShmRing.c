@@ -0,0 +1,166 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * A memfd backed ring of finished fragments, see ShmRing.h for what
+ * readers see. Fragments are copied in once, under the session's lock,
+ * and never wrap: one that does not fit at the end goes to the start.
+ * The file is sealed against resizing so a mapping stays valid for as
+ * long as a reader keeps it.
+ */
+
+#define _GNU_SOURCE
+#include <gst/gst.h>
+
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/memfd.h>
+
+/* older C libraries know neither memfd_create nor the seals */
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS           (1024 + 9)
+#define F_SEAL_SEAL           0x0001
+#define F_SEAL_SHRINK         0x0002
+#define F_SEAL_GROW           0x0004
+#endif
+
+#include "ShmRing.h"
+
+#define SHM_RING_INIT_MAX     (64 * 1024)
+
+struct ShmRing
+{
+  int fd;
+  guint8 *base;
+  gsize size;
+  ShmRingHeader *hdr;
+  guint64 written;
+};
+
+static void
+wake_readers (ShmRing *ring)
+{
+  __atomic_add_fetch (&ring->hdr->wake, 1, __ATOMIC_RELEASE);
+  syscall (SYS_futex, &ring->hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+ShmRing*
+shm_ring_new (const char *name, gsize data_size, guint slots)
+{
+  ShmRing *ring;
+  gsize page = sysconf (_SC_PAGESIZE), index;
+  int fd;
+
+  fd = syscall (SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    g_warning ("no shared memory for %s: %s", name, g_strerror (errno));
+    return NULL;
+  }
+
+  ring = g_slice_new0 (ShmRing);
+  ring->fd = fd;
+  index = (sizeof (ShmRingHeader) + slots * sizeof (ShmRingSlot) + page - 1)
+      / page * page;
+  data_size = (data_size + page - 1) / page * page;
+  ring->size = index + SHM_RING_INIT_MAX + data_size;
+
+  if (ftruncate (fd, ring->size) < 0 ||
+      (ring->base = mmap (NULL, ring->size, PROT_READ | PROT_WRITE,
+          MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    g_warning ("cannot map shared memory for %s: %s", name, g_strerror (errno));
+    close (fd);
+    g_slice_free (ShmRing, ring);
+    return NULL;
+  }
+  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+  ring->hdr = (ShmRingHeader*) ring->base;
+  ring->hdr->version = SHM_RING_VERSION;
+  ring->hdr->slots = slots;
+  ring->hdr->init_max = SHM_RING_INIT_MAX;
+  ring->hdr->init_offset = index;
+  ring->hdr->data_offset = index + SHM_RING_INIT_MAX;
+  ring->hdr->data_size = data_size;
+  /* readers check the magic last */
+  __atomic_store_n (&ring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+  return ring;
+}
+
+void
+shm_ring_set_init (ShmRing *ring, GstBuffer *init)
+{
+  ShmRingHeader *hdr = ring->hdr;
+  gsize size = gst_buffer_get_size (init);
+
+  if (size > hdr->init_max) {
+    g_warning ("init segment of %" G_GSIZE_FORMAT " bytes does not fit", size);
+    return;
+  }
+
+  __atomic_add_fetch (&hdr->init_seq, 1, __ATOMIC_ACQ_REL);
+  gst_buffer_extract (init, 0, ring->base + hdr->init_offset, size);
+  hdr->init_size = size;
+  __atomic_add_fetch (&hdr->init_seq, 1, __ATOMIC_RELEASE);
+  wake_readers (ring);
+}
+
+void
+shm_ring_publish (ShmRing *ring, GstBuffer *frag, guint32 flags)
+{
+  ShmRingHeader *hdr = ring->hdr;
+  gsize size = gst_buffer_get_size (frag);
+  guint64 pos = ring->written, n = hdr->head;
+  ShmRingSlot *slot = &hdr->index[n % hdr->slots];
+
+  if (size > hdr->data_size)
+    return;
+  if (pos % hdr->data_size + size > hdr->data_size)
+    pos += hdr->data_size - pos % hdr->data_size;
+
+  /* readers of whatever lived there see it is gone before it changes */
+  __atomic_store_n (&hdr->reserve, pos + size, __ATOMIC_RELEASE);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  gst_buffer_extract (frag, 0, ring->base + hdr->data_offset +
+      pos % hdr->data_size, size);
+
+  __atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  slot->pos = pos;
+  slot->size = size;
+  slot->flags = flags;
+  __atomic_store_n (&slot->seq, n + 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&hdr->head, n + 1, __ATOMIC_RELEASE);
+
+  ring->written = pos + size;
+  wake_readers (ring);
+}
+
+int
+shm_ring_fd (ShmRing *ring)
+{
+  return ring ? ring->fd : -1;
+}
+
+/* mappings readers hold stay valid after this */
+void
+shm_ring_free (ShmRing *ring)
+{
+  if (!ring)
+    return;
+
+  munmap (ring->base, ring->size);
+  close (ring->fd);
+  g_slice_free (ShmRing, ring);
+}
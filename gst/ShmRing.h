@@ -0,0 +1,72 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <gst/gst.h>
+#include <stdint.h>
+
+/*
+ * Layout of the shared memory a session publishes its fragments to, for
+ * processes on the same host that map it read-only. The producer never
+ * waits for anybody; a reader that falls behind finds its fragments
+ * overwritten and picks up again from the newest one.
+ *
+ * Reading fragment n (head is the next one to be written):
+ *   - slot = index[n % slots]; read seq, then pos, size, flags, then seq
+ *     again: both must be n + 1, otherwise the slot was being rewritten
+ *   - the data is at data_offset + pos % data_size
+ *   - after using it, reserve must still be <= pos + data_size, or the
+ *     producer has started overwriting it meanwhile and it is garbage
+ *   - wait for more with FUTEX_WAIT on wake (shared, not private)
+ * The init segment (ftyp + moov) is read the same way with init_seq,
+ * which is odd while it is being replaced.
+ */
+
+#define SHM_RING_MAGIC        0x52534656   /* "VFSR" */
+#define SHM_RING_VERSION      1
+
+#define SHM_RING_KEY          (1 << 0)     /* fragment holds a keyframe */
+
+typedef struct
+{
+  volatile uint64_t seq;
+  uint64_t pos;
+  uint32_t size;
+  uint32_t flags;
+} ShmRingSlot;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t init_max;
+  uint64_t init_offset;
+  uint64_t data_offset;
+  uint64_t data_size;
+
+  volatile uint64_t init_seq;
+  volatile uint32_t init_size;
+  volatile uint32_t wake;
+  volatile uint64_t head;
+  volatile uint64_t reserve;
+
+  ShmRingSlot index[];
+} ShmRingHeader;
+
+typedef struct ShmRing ShmRing;
+
+ShmRing*        shm_ring_new (const char*, gsize, guint);
+void            shm_ring_set_init (ShmRing*, GstBuffer*);
+void            shm_ring_publish (ShmRing*, GstBuffer*, guint32);
+int             shm_ring_fd (ShmRing*);
+void            shm_ring_free (ShmRing*);
+
+#endif
@@ -0,0 +1,666 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Simulated DLNA MediaRenderers for load testing without TVs.
+ *
+ *   vfsim [-n instances] [-i interface] [-d action-delay-ms] [-s sink-info]
+ *
+ * Every instance announces itself over SSDP, answers ConnectionManager,
+ * AVTransport and RenderingControl, and on Play pulls the URI given with
+ * SetAVTransportURI the way a TV would, reporting time to first byte,
+ * throughput and stalls.
+ */
+
+#include <libgupnp/gupnp.h>
+#include <libsoup/soup.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STALL_US      (500 * 1000)
+#define READ_SIZE     (64 * 1024)
+#define REPORT_SEC    5
+
+#define AVT_SERVICE   "urn:schemas-upnp-org:service:AVTransport:1"
+#define CM_SERVICE    "urn:schemas-upnp-org:service:ConnectionManager:1"
+#define RC_SERVICE    "urn:schemas-upnp-org:service:RenderingControl:1"
+
+/* All instances share one context, every path carries the instance or
+ * each new service would take over the handlers of the one before. */
+static const char *device_xml =
+  "<?xml version=\"1.0\"?>\n"
+  "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+  " <specVersion><major>1</major><minor>0</minor></specVersion>\n"
+  " <device>\n"
+  "  <deviceType>urn:schemas-upnp-org:device:MediaRenderer:1</deviceType>\n"
+  "  <friendlyName>vfsim %1$d</friendlyName>\n"
+  "  <manufacturer>vfstream</manufacturer>\n"
+  "  <modelName>vfsim</modelName>\n"
+  "  <UDN>uuid:5f1e0a00-7673-696d-0000-%1$012d</UDN>\n"
+  "  <serviceList>\n"
+  "   <service>\n"
+  "    <serviceType>" CM_SERVICE "</serviceType>\n"
+  "    <serviceId>urn:upnp-org:serviceId:ConnectionManager</serviceId>\n"
+  "    <SCPDURL>/dmr%1$d/cm.xml</SCPDURL>\n"
+  "    <controlURL>/dmr%1$d/cm/control</controlURL>\n"
+  "    <eventSubURL>/dmr%1$d/cm/event</eventSubURL>\n"
+  "   </service>\n"
+  "   <service>\n"
+  "    <serviceType>" AVT_SERVICE "</serviceType>\n"
+  "    <serviceId>urn:upnp-org:serviceId:AVTransport</serviceId>\n"
+  "    <SCPDURL>/dmr%1$d/avt.xml</SCPDURL>\n"
+  "    <controlURL>/dmr%1$d/avt/control</controlURL>\n"
+  "    <eventSubURL>/dmr%1$d/avt/event</eventSubURL>\n"
+  "   </service>\n"
+  "   <service>\n"
+  "    <serviceType>" RC_SERVICE "</serviceType>\n"
+  "    <serviceId>urn:upnp-org:serviceId:RenderingControl</serviceId>\n"
+  "    <SCPDURL>/dmr%1$d/rc.xml</SCPDURL>\n"
+  "    <controlURL>/dmr%1$d/rc/control</controlURL>\n"
+  "    <eventSubURL>/dmr%1$d/rc/event</eventSubURL>\n"
+  "   </service>\n"
+  "  </serviceList>\n"
+  " </device>\n"
+  "</root>\n";
+
+#define SCPD_HEAD \
+  "<?xml version=\"1.0\"?>\n" \
+  "<scpd xmlns=\"urn:schemas-upnp-org:service-1-0\">\n" \
+  " <specVersion><major>1</major><minor>0</minor></specVersion>\n"
+
+#define ARG(name, dir, var) \
+  "<argument><name>" name "</name><direction>" dir "</direction>" \
+  "<relatedStateVariable>" var "</relatedStateVariable></argument>"
+
+#define INSTANCE ARG ("InstanceID", "in", "A_ARG_TYPE_InstanceID")
+
+#define VAR(name, type, events) \
+  "<stateVariable sendEvents=\"" events "\"><name>" name "</name>" \
+  "<dataType>" type "</dataType></stateVariable>"
+
+static const char *cm_scpd =
+  SCPD_HEAD
+  " <actionList>\n"
+  "  <action><name>GetProtocolInfo</name><argumentList>"
+  ARG ("Source", "out", "SourceProtocolInfo")
+  ARG ("Sink", "out", "SinkProtocolInfo")
+  "</argumentList></action>\n"
+  " </actionList>\n"
+  " <serviceStateTable>\n"
+  VAR ("SourceProtocolInfo", "string", "yes")
+  VAR ("SinkProtocolInfo", "string", "yes")
+  " </serviceStateTable>\n"
+  "</scpd>\n";
+
+static const char *avt_scpd =
+  SCPD_HEAD
+  " <actionList>\n"
+  "  <action><name>SetAVTransportURI</name><argumentList>"
+  INSTANCE
+  ARG ("CurrentURI", "in", "AVTransportURI")
+  ARG ("CurrentURIMetaData", "in", "AVTransportURIMetaData")
+  "</argumentList></action>\n"
+  "  <action><name>Play</name><argumentList>"
+  INSTANCE
+  ARG ("Speed", "in", "TransportPlaySpeed")
+  "</argumentList></action>\n"
+  "  <action><name>Stop</name><argumentList>"
+  INSTANCE
+  "</argumentList></action>\n"
+  "  <action><name>GetTransportInfo</name><argumentList>"
+  INSTANCE
+  ARG ("CurrentTransportState", "out", "TransportState")
+  ARG ("CurrentTransportStatus", "out", "TransportStatus")
+  ARG ("CurrentSpeed", "out", "TransportPlaySpeed")
+  "</argumentList></action>\n"
+  " </actionList>\n"
+  " <serviceStateTable>\n"
+  VAR ("LastChange", "string", "yes")
+  VAR ("TransportState", "string", "no")
+  VAR ("TransportStatus", "string", "no")
+  VAR ("TransportPlaySpeed", "string", "no")
+  VAR ("AVTransportURI", "string", "no")
+  VAR ("AVTransportURIMetaData", "string", "no")
+  VAR ("A_ARG_TYPE_InstanceID", "ui4", "no")
+  " </serviceStateTable>\n"
+  "</scpd>\n";
+
+static const char *rc_scpd =
+  SCPD_HEAD
+  " <actionList>\n"
+  "  <action><name>GetVolume</name><argumentList>"
+  INSTANCE
+  ARG ("Channel", "in", "A_ARG_TYPE_Channel")
+  ARG ("CurrentVolume", "out", "Volume")
+  "</argumentList></action>\n"
+  " </actionList>\n"
+  " <serviceStateTable>\n"
+  VAR ("LastChange", "string", "yes")
+  VAR ("Volume", "ui2", "no")
+  VAR ("A_ARG_TYPE_Channel", "string", "no")
+  VAR ("A_ARG_TYPE_InstanceID", "ui4", "no")
+  " </serviceStateTable>\n"
+  "</scpd>\n";
+
+typedef struct
+{
+  int                id;
+  GUPnPRootDevice   *root;
+  GUPnPServiceInfo  *avt;
+  GUPnPServiceInfo  *cm;
+  GUPnPServiceInfo  *rc;
+  gchar             *uri;
+  const char        *state;
+
+  GCancellable      *cancel;
+  SoupMessage       *msg;
+  GInputStream      *stream;
+  guint8            *buf;
+  gint64             play_at;
+  gint64             last_read;
+  gint64             ttfb;
+  guint64            bytes;
+  guint64            window_bytes;
+  guint              stalls;
+} SimRenderer;
+
+static int instances = 1;
+static int action_delay = 0;
+static const char *iface = "lo";
+static const char *sink_info =
+  "http-get:*:video/mp4:DLNA.ORG_PN=AVC_MP4_BL_CIF15_AAC_520,"
+  "http-get:*:video/mp4:DLNA.ORG_PN=AVC_MP4_BL_L3L_SD_AAC,"
+  "http-get:*:video/mp4:DLNA.ORG_PN=AVC_MP4_MP_HD_720p_AAC";
+
+static SoupSession *session;
+static SimRenderer *renderers;
+
+typedef void (*ActionHandler) (GUPnPService*, GUPnPServiceAction*, gpointer);
+
+typedef struct
+{
+  ActionHandler      handler;
+  SimRenderer       *renderer;
+  GUPnPService      *service;
+  GUPnPServiceAction *action;
+} PendingAction;
+
+static gboolean
+delayed_action_cb (gpointer data)
+{
+  PendingAction *p = data;
+
+  p->handler (p->service, p->action, p->renderer);
+  g_object_unref (p->service);
+  g_slice_free (PendingAction, p);
+
+  return FALSE;
+}
+
+/* The main loop runs every simulated renderer and every fetch, so a slow
+ * renderer must not block it: the action is held on to and answered from
+ * a timeout once the delay is up. */
+static void
+action_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  PendingAction *bind = user_data, *p;
+
+  if (action_delay <= 0) {
+    bind->handler (service, action, bind->renderer);
+    return;
+  }
+
+  p = g_slice_new (PendingAction);
+  p->handler = bind->handler;
+  p->renderer = bind->renderer;
+  p->service = g_object_ref (service);
+  p->action = action;
+  g_timeout_add (action_delay, delayed_action_cb, p);
+}
+
+static void
+free_binding (gpointer data, GClosure *closure)
+{
+  g_slice_free (PendingAction, data);
+}
+
+static void
+connect_action (GUPnPServiceInfo *service, const char *name,
+    ActionHandler handler, SimRenderer *r)
+{
+  PendingAction *bind = g_slice_new0 (PendingAction);
+  gchar *signal = g_strdup_printf ("action-invoked::%s", name);
+
+  bind->handler = handler;
+  bind->renderer = r;
+  g_signal_connect_data (service, signal, G_CALLBACK (action_cb), bind,
+      free_binding, 0);
+  g_free (signal);
+}
+
+static void
+notify_state (SimRenderer *r, const char *state)
+{
+  gchar *lc;
+
+  r->state = state;
+  lc = g_strdup_printf ("<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
+      "<InstanceID val=\"0\"><TransportState val=\"%s\"/></InstanceID></Event>",
+      state);
+  gupnp_service_notify (GUPNP_SERVICE (r->avt), "LastChange",
+      G_TYPE_STRING, lc, NULL);
+  g_free (lc);
+}
+
+static void
+stop_fetch (SimRenderer *r)
+{
+  if (r->cancel) {
+    g_cancellable_cancel (r->cancel);
+    g_object_unref (r->cancel);
+    r->cancel = NULL;
+  }
+  g_clear_object (&r->msg);
+  if (r->stream) {
+    g_object_unref (r->stream);
+    r->stream = NULL;
+  }
+}
+
+static void read_next (SimRenderer *r);
+
+static void
+read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SimRenderer *r = user_data;
+  GError *error = NULL;
+  gssize n;
+  gint64 now;
+
+  n = g_input_stream_read_finish (G_INPUT_STREAM (source), res, &error);
+  if (n <= 0) {
+    /* a cancelled read belongs to a fetch that is already torn down */
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_error_free (error);
+      return;
+    }
+    if (error)
+      g_print ("[%d] stream error: %s\n", r->id, error->message);
+    else
+      g_print ("[%d] stream ended after %" G_GUINT64_FORMAT " bytes\n",
+          r->id, r->bytes);
+    g_clear_error (&error);
+    g_clear_object (&r->stream);
+    return;
+  }
+
+  now = g_get_monotonic_time ();
+  if (r->ttfb < 0) {
+    r->ttfb = now - r->play_at;
+    g_print ("[%d] time to first byte %" G_GINT64_FORMAT " ms\n",
+        r->id, r->ttfb / 1000);
+  } else if (now - r->last_read > STALL_US) {
+    r->stalls++;
+    g_print ("[%d] stalled for %" G_GINT64_FORMAT " ms\n",
+        r->id, (now - r->last_read) / 1000);
+  }
+
+  r->last_read = now;
+  r->bytes += n;
+  r->window_bytes += n;
+  read_next (r);
+}
+
+static void
+read_next (SimRenderer *r)
+{
+  g_input_stream_read_async (r->stream, r->buf, READ_SIZE,
+      G_PRIORITY_DEFAULT, r->cancel, read_cb, r);
+}
+
+static void
+send_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  SimRenderer *r = user_data;
+  GError *error = NULL;
+  GInputStream *stream;
+
+  stream = soup_session_send_finish (SOUP_SESSION (source), res, &error);
+  if (!stream) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_print ("[%d] GET %s failed: %s\n", r->id, r->uri, error->message);
+    g_error_free (error);
+    return;
+  }
+
+  /* an error page is not a stream, nor is its first byte a TTFB */
+  if (!SOUP_STATUS_IS_SUCCESSFUL (r->msg->status_code)) {
+    g_print ("[%d] GET %s failed: %u %s\n", r->id, r->uri,
+        r->msg->status_code, r->msg->reason_phrase);
+    g_object_unref (stream);
+    return;
+  }
+
+  r->stream = stream;
+  read_next (r);
+}
+
+static void
+start_fetch (SimRenderer *r)
+{
+  SoupMessage *msg;
+
+  stop_fetch (r);
+  msg = soup_message_new ("GET", r->uri);
+  if (!msg) {
+    g_print ("[%d] bad URI %s\n", r->id, r->uri);
+    return;
+  }
+
+  r->cancel = g_cancellable_new ();
+  r->play_at = g_get_monotonic_time ();
+  r->last_read = r->play_at;
+  r->ttfb = -1;
+  r->bytes = r->window_bytes = 0;
+  r->stalls = 0;
+  r->msg = msg;
+  soup_session_send_async (session, msg, r->cancel, send_cb, r);
+}
+
+static void
+get_protocol_info_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  gupnp_service_action_set (action,
+      "Source", G_TYPE_STRING, "",
+      "Sink", G_TYPE_STRING, sink_info,
+      NULL);
+  gupnp_service_action_return (action);
+}
+
+static void
+set_uri_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  SimRenderer *r = user_data;
+
+  stop_fetch (r);
+  g_free (r->uri);
+  gupnp_service_action_get (action,
+      "CurrentURI", G_TYPE_STRING, &r->uri,
+      NULL);
+  gupnp_service_action_return (action);
+  notify_state (r, "STOPPED");
+}
+
+static void
+play_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  SimRenderer *r = user_data;
+
+  if (!r->uri) {
+    gupnp_service_action_return_error (action, 701, "Transition not available");
+    return;
+  }
+
+  gupnp_service_action_return (action);
+  notify_state (r, "TRANSITIONING");
+  start_fetch (r);
+  notify_state (r, "PLAYING");
+}
+
+static void
+stop_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  SimRenderer *r = user_data;
+
+  stop_fetch (r);
+  gupnp_service_action_return (action);
+  notify_state (r, "STOPPED");
+}
+
+static void
+get_transport_info_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  SimRenderer *r = user_data;
+
+  gupnp_service_action_set (action,
+      "CurrentTransportState", G_TYPE_STRING, r->state,
+      "CurrentTransportStatus", G_TYPE_STRING, "OK",
+      "CurrentSpeed", G_TYPE_STRING, "1",
+      NULL);
+  gupnp_service_action_return (action);
+}
+
+static void
+get_volume_cb (GUPnPService *service, GUPnPServiceAction *action,
+    gpointer user_data)
+{
+  gupnp_service_action_set (action, "CurrentVolume", G_TYPE_UINT, 50, NULL);
+  gupnp_service_action_return (action);
+}
+
+static gboolean
+report_cb (gpointer data)
+{
+  guint64 total = 0;
+  int i, streaming = 0;
+
+  for (i = 0; i < instances; i++) {
+    SimRenderer *r = &renderers[i];
+
+    if (!r->stream)
+      continue;
+    streaming++;
+    total += r->window_bytes;
+    g_print ("[%d] %s %.1f kbit/s ttfb %" G_GINT64_FORMAT " ms stalls %u\n",
+        r->id, r->state, r->window_bytes * 8.0 / 1000 / REPORT_SEC,
+        r->ttfb / 1000, r->stalls);
+    r->window_bytes = 0;
+  }
+
+  if (streaming)
+    g_print ("%d streams, %.1f kbit/s total\n", streaming,
+        total * 8.0 / 1000 / REPORT_SEC);
+
+  return TRUE;
+}
+
+static gboolean
+write_file (const char *dir, const char *name, const char *contents)
+{
+  gchar *path = g_build_filename (dir, name, NULL);
+  gboolean ok = g_file_set_contents (path, contents, -1, NULL);
+
+  g_free (path);
+  return ok;
+}
+
+static void
+remove_file (const char *dir, const char *name)
+{
+  gchar *path = g_build_filename (dir, name, NULL);
+
+  g_unlink (path);
+  g_free (path);
+}
+
+static gboolean
+write_descriptions (const char *dir)
+{
+  int i;
+
+  for (i = 0; i < instances; i++) {
+    gchar *sub = g_strdup_printf ("dmr%d", i);
+    gchar *path = g_build_filename (dir, sub, NULL);
+    gchar *name = g_strdup_printf ("dmr%d.xml", i);
+    gchar *xml = g_strdup_printf (device_xml, i);
+    gboolean ok = g_mkdir (path, 0700) == 0 &&
+        write_file (path, "cm.xml", cm_scpd) &&
+        write_file (path, "avt.xml", avt_scpd) &&
+        write_file (path, "rc.xml", rc_scpd) &&
+        write_file (dir, name, xml);
+
+    g_free (xml);
+    g_free (name);
+    g_free (path);
+    g_free (sub);
+    if (!ok)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+remove_descriptions (const char *dir)
+{
+  int i;
+
+  for (i = 0; i < instances; i++) {
+    gchar *sub = g_strdup_printf ("dmr%d", i);
+    gchar *path = g_build_filename (dir, sub, NULL);
+    gchar *name = g_strdup_printf ("dmr%d.xml", i);
+
+    remove_file (path, "cm.xml");
+    remove_file (path, "avt.xml");
+    remove_file (path, "rc.xml");
+    g_rmdir (path);
+    remove_file (dir, name);
+    g_free (name);
+    g_free (path);
+    g_free (sub);
+  }
+  g_rmdir (dir);
+}
+
+static gboolean
+quit_cb (gpointer loop)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static gboolean
+start_renderer (GUPnPContext *context, const char *dir, SimRenderer *r)
+{
+  gchar *name = g_strdup_printf ("dmr%d.xml", r->id);
+
+  r->root = gupnp_root_device_new (context, name, dir);
+  g_free (name);
+  if (!r->root)
+    return FALSE;
+
+  r->state = "NO_MEDIA_PRESENT";
+  r->buf = g_malloc (READ_SIZE);
+  r->cm = gupnp_device_info_get_service (GUPNP_DEVICE_INFO (r->root),
+      CM_SERVICE);
+  r->avt = gupnp_device_info_get_service (GUPNP_DEVICE_INFO (r->root),
+      AVT_SERVICE);
+  r->rc = gupnp_device_info_get_service (GUPNP_DEVICE_INFO (r->root),
+      RC_SERVICE);
+
+  connect_action (r->cm, "GetProtocolInfo", get_protocol_info_cb, r);
+  connect_action (r->avt, "SetAVTransportURI", set_uri_cb, r);
+  connect_action (r->avt, "Play", play_cb, r);
+  connect_action (r->avt, "Stop", stop_cb, r);
+  connect_action (r->avt, "GetTransportInfo", get_transport_info_cb, r);
+  connect_action (r->rc, "GetVolume", get_volume_cb, r);
+
+  gupnp_root_device_set_available (r->root, TRUE);
+
+  return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+  GUPnPContext *context;
+  GMainLoop *loop;
+  GError *error = NULL;
+  gchar *dir;
+  int opt, i;
+
+  while ((opt = getopt (argc, argv, "n:i:d:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        instances = atoi (optarg);
+        break;
+      case 'i':
+        iface = optarg;
+        break;
+      case 'd':
+        action_delay = atoi (optarg);
+        break;
+      case 's':
+        sink_info = optarg;
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-n instances] [-i interface] "
+            "[-d action-delay-ms] [-s sink-protocol-info]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (instances < 1)
+    instances = 1;
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+  g_type_init ();
+#endif
+
+  context = gupnp_context_new (NULL, iface, 0, &error);
+  if (!context) {
+    fprintf (stderr, "failed to create context on %s: %s\n", iface,
+        error->message);
+    return 1;
+  }
+
+  dir = g_dir_make_tmp ("vfsim-XXXXXX", NULL);
+  if (!dir || !write_descriptions (dir)) {
+    fprintf (stderr, "failed to write device descriptions\n");
+    if (dir)
+      remove_descriptions (dir);
+    return 1;
+  }
+
+  session = soup_session_new ();
+  renderers = g_new0 (SimRenderer, instances);
+  for (i = 0; i < instances; i++) {
+    renderers[i].id = i;
+    if (!start_renderer (context, dir, &renderers[i])) {
+      fprintf (stderr, "failed to start renderer %d\n", i);
+      remove_descriptions (dir);
+      return 1;
+    }
+  }
+
+  g_print ("%d renderer(s) up on %s:%u\n", instances, iface,
+      gupnp_context_get_port (context));
+
+  g_timeout_add_seconds (REPORT_SEC, report_cb, NULL);
+  loop = g_main_loop_new (NULL, FALSE);
+  g_unix_signal_add (SIGINT, quit_cb, loop);
+  g_unix_signal_add (SIGTERM, quit_cb, loop);
+  g_main_loop_run (loop);
+
+  remove_descriptions (dir);
+  g_free (dir);
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * JPEG stills of raw frames. The frames are 4:2:0 already, which is what
+ * a JPEG holds, so the planes go to libjpeg as raw data: no colour
+ * conversion and no downsampling on the way.
+ */
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/app/gstappsink.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include "Elements.h"
+#include "Snapshot.h"
+
+#define SNAPSHOT_WARMUP       5           /* frames to let the camera settle */
+#define SNAPSHOT_TIMEOUT      (2 * GST_SECOND)
+
+struct snapshot_error {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void
+snapshot_error_exit (j_common_ptr cinfo)
+{
+  struct snapshot_error *err = (struct snapshot_error*) cinfo->err;
+
+  (*cinfo->err->output_message) (cinfo);
+  longjmp (err->jump, 1);
+}
+
+/* one row, edge pixels repeated out to the padded MCU width */
+static void
+copy_row (JSAMPROW dst, const guint8 *src, int pstride, int w, int wpad)
+{
+  int x;
+
+  if (pstride == 1) {
+    memcpy (dst, src, w);
+  } else {
+    for (x = 0; x < w; x++)
+      dst[x] = src[x * pstride];
+  }
+  memset (dst + w, dst[w - 1], wpad - w);
+}
+
+/* JPEG of an I420, YV12 or NV12 frame, in memory from malloc */
+unsigned char*
+snapshot_encode (GstBuffer *buf, GstCaps *caps, int quality,
+    unsigned long *size)
+{
+  struct jpeg_compress_struct cinfo;
+  struct snapshot_error jerr;
+  GstVideoInfo vinfo;
+  GstVideoFrame frame;
+  GstVideoFormat fmt;
+  JSAMPROW yrows[16], urows[8], vrows[8];
+  JSAMPARRAY planes[3] = { yrows, urows, vrows };
+  unsigned char * volatile out = NULL;
+  unsigned long outsize = 0;
+  guint8 *rows;
+  int w, h, cw, ch, wpad, i, y;
+
+  if (!caps || !gst_video_info_from_caps (&vinfo, caps))
+    return NULL;
+
+  fmt = GST_VIDEO_INFO_FORMAT (&vinfo);
+  if (fmt != GST_VIDEO_FORMAT_I420 && fmt != GST_VIDEO_FORMAT_YV12 &&
+      fmt != GST_VIDEO_FORMAT_NV12)
+    return NULL;
+  if (!gst_video_frame_map (&frame, &vinfo, buf, GST_MAP_READ))
+    return NULL;
+
+  w = GST_VIDEO_FRAME_WIDTH (&frame);
+  h = GST_VIDEO_FRAME_HEIGHT (&frame);
+  cw = GST_VIDEO_FRAME_COMP_WIDTH (&frame, 1);
+  ch = GST_VIDEO_FRAME_COMP_HEIGHT (&frame, 1);
+  wpad = (w + 15) & ~15;
+
+  rows = g_malloc (wpad * 16 + wpad / 2 * 16);
+  for (i = 0; i < 16; i++)
+    yrows[i] = rows + i * wpad;
+  for (i = 0; i < 8; i++) {
+    urows[i] = rows + wpad * 16 + i * (wpad / 2);
+    vrows[i] = rows + wpad * 16 + (8 + i) * (wpad / 2);
+  }
+
+  cinfo.err = jpeg_std_error (&jerr.pub);
+  jerr.pub.error_exit = snapshot_error_exit;
+  if (setjmp (jerr.jump)) {
+    jpeg_destroy_compress (&cinfo);
+    free (out);
+    out = NULL;
+    goto done;
+  }
+
+  jpeg_create_compress (&cinfo);
+  jpeg_mem_dest (&cinfo, (unsigned char**) &out, &outsize);
+
+  cinfo.image_width = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults (&cinfo);
+  jpeg_set_quality (&cinfo, quality, TRUE);
+  cinfo.raw_data_in = TRUE;
+  cinfo.dct_method = JDCT_IFAST;
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 2;
+  cinfo.comp_info[1].h_samp_factor = 1;
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;
+  cinfo.comp_info[2].v_samp_factor = 1;
+
+  jpeg_start_compress (&cinfo, TRUE);
+  for (y = 0; y < h; y += 16) {
+    for (i = 0; i < 16; i++)
+      copy_row (yrows[i], GST_VIDEO_FRAME_COMP_DATA (&frame, 0) +
+          MIN (y + i, h - 1) * GST_VIDEO_FRAME_COMP_STRIDE (&frame, 0),
+          GST_VIDEO_FRAME_COMP_PSTRIDE (&frame, 0), w, wpad);
+    for (i = 0; i < 8; i++) {
+      int cy = MIN (y / 2 + i, ch - 1);
+
+      copy_row (urows[i], GST_VIDEO_FRAME_COMP_DATA (&frame, 1) +
+          cy * GST_VIDEO_FRAME_COMP_STRIDE (&frame, 1),
+          GST_VIDEO_FRAME_COMP_PSTRIDE (&frame, 1), cw, wpad / 2);
+      copy_row (vrows[i], GST_VIDEO_FRAME_COMP_DATA (&frame, 2) +
+          cy * GST_VIDEO_FRAME_COMP_STRIDE (&frame, 2),
+          GST_VIDEO_FRAME_COMP_PSTRIDE (&frame, 2), cw, wpad / 2);
+    }
+    jpeg_write_raw_data (&cinfo, planes, 16);
+  }
+  jpeg_finish_compress (&cinfo);
+  jpeg_destroy_compress (&cinfo);
+  *size = outsize;
+
+done:
+  g_free (rows);
+  gst_video_frame_unmap (&frame);
+
+  return out;
+}
+
+/* A still straight from the camera when no session is running: a capture
+ * only pipeline that lives for a handful of frames */
+int
+captureSnapshot (int quality, char **data, int *size)
+{
+  GstElement *bin, *vsrc, *vconv, *vcaps, *vsink;
+  GstSample *sample = NULL, *s;
+  GstCaps *caps;
+  unsigned long len = 0;
+  int i, ret = -1;
+
+  initMedia ();
+
+  bin = gst_pipeline_new (NULL);
+  vsrc = make_element ("v4l2src");
+  vconv = make_element ("videoconvert");
+  vcaps = make_element ("capsfilter");
+  vsink = make_element ("appsink");
+
+  caps = gst_caps_new_simple ("video/x-raw",
+      "format", G_TYPE_STRING, "I420", NULL);
+  g_object_set (G_OBJECT (vcaps), "caps", caps, NULL);
+  gst_caps_unref (caps);
+  g_object_set (G_OBJECT (vsink), "sync", FALSE, "max-buffers", 1,
+      "drop", TRUE, NULL);
+
+  gst_bin_add_many (GST_BIN (bin), vsrc, vconv, vcaps, vsink, NULL);
+  gst_element_link_many (vsrc, vconv, vcaps, vsink, NULL);
+
+  if (gst_element_set_state (bin, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_FAILURE) {
+    g_print ("snapshot: camera not available\n");
+    goto done;
+  }
+
+  for (i = 0; i < SNAPSHOT_WARMUP; i++) {
+    s = gst_app_sink_try_pull_sample (GST_APP_SINK (vsink), SNAPSHOT_TIMEOUT);
+    if (!s)
+      break;
+    if (sample)
+      gst_sample_unref (sample);
+    sample = s;
+  }
+
+  if (sample) {
+    *data = (char*) snapshot_encode (gst_sample_get_buffer (sample),
+        gst_sample_get_caps (sample), quality, &len);
+    *size = len;
+    if (*data)
+      ret = 0;
+    gst_sample_unref (sample);
+  }
+
+done:
+  gst_element_set_state (bin, GST_STATE_NULL);
+  gst_object_unref (bin);
+
+  return ret;
+}
@@ -0,0 +1,17 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <gst/gst.h>
+
+unsigned char*  snapshot_encode (GstBuffer*, GstCaps*, int, unsigned long*);
+int             captureSnapshot (int quality, char **data, int *size);
+
+#endif
@@ -0,0 +1,198 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+/*
+ * Streaming threads for every pipeline come out of one process-wide
+ * thread pool instead of each GstTask spawning its own. A finished task
+ * leaves its thread behind for the next session, at most one idle thread
+ * per core is kept around. Each pool handle is bound to a core and pins
+ * the thread it hands a task to, so a session's capture, convert and
+ * encode all run on the same core. Cores are counted within the process's
+ * affinity mask, so core 0 is the first one the process may run on.
+ */
+
+#define _GNU_SOURCE
+#include <gst/gst.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "TaskPool.h"
+
+typedef struct
+{
+  GstTaskPool parent;
+  gint cpu;
+} PinnedPool;
+
+typedef struct
+{
+  GstTaskPoolClass parent_class;
+} PinnedPoolClass;
+
+typedef struct
+{
+  GstTaskPoolFunction func;
+  gpointer data;
+  gint cpu;
+} PoolJob;
+
+G_DEFINE_TYPE (PinnedPool, pinned_pool, GST_TYPE_TASK_POOL);
+
+static GThreadPool *shared;
+static PinnedPool **pools;
+static gint *cpus;          /* the cores the process is allowed on */
+static guint n_cpus;
+
+static void task_pool_init (void);
+
+void
+task_pool_pin (int cpu)
+{
+  cpu_set_t set;
+  int core, err;
+
+  task_pool_init ();
+  core = cpus[(guint) cpu % n_cpus];
+
+  CPU_ZERO (&set);
+  CPU_SET (core, &set);
+  err = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+  if (err != 0)
+    g_warning ("could not pin thread to core %d: %s", core, g_strerror (err));
+}
+
+static void
+run_job (gpointer data, gpointer user_data)
+{
+  PoolJob *job = data;
+
+  /* threads are recycled across sessions, pin again every time */
+  task_pool_pin (job->cpu);
+  job->func (job->data);
+  g_slice_free (PoolJob, job);
+}
+
+static void
+pinned_pool_prepare (GstTaskPool *pool, GError **error)
+{
+  /* nothing to do, all handles share the process wide pool */
+}
+
+static void
+pinned_pool_cleanup (GstTaskPool *pool)
+{
+}
+
+static gpointer
+pinned_pool_push (GstTaskPool *pool, GstTaskPoolFunction func,
+    gpointer data, GError **error)
+{
+  PoolJob *job = g_slice_new (PoolJob);
+
+  job->func = func;
+  job->data = data;
+  job->cpu = ((PinnedPool*) pool)->cpu;
+  g_thread_pool_push (shared, job, error);
+
+  return NULL;
+}
+
+static void
+pinned_pool_join (GstTaskPool *pool, gpointer id)
+{
+  /* the task waits for its own function to return, like the default
+   * pool there is nothing left to join */
+}
+
+static void
+pinned_pool_class_init (PinnedPoolClass *klass)
+{
+  GstTaskPoolClass *pool_class = (GstTaskPoolClass*) klass;
+
+  pool_class->prepare = pinned_pool_prepare;
+  pool_class->cleanup = pinned_pool_cleanup;
+  pool_class->push = pinned_pool_push;
+  pool_class->join = pinned_pool_join;
+}
+
+static void
+pinned_pool_init (PinnedPool *pool)
+{
+}
+
+static void
+task_pool_init (void)
+{
+  static gsize initialized = 0;
+
+  if (!g_once_init_enter (&initialized))
+    return;
+
+  {
+    cpu_set_t set;
+    int i;
+
+    /* inside a cpuset the allowed cores need not start at 0 or be
+     * contiguous */
+    CPU_ZERO (&set);
+    if (sched_getaffinity (0, sizeof (set), &set) == 0 && CPU_COUNT (&set) > 0) {
+      cpus = g_new (gint, CPU_COUNT (&set));
+      for (i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET (i, &set))
+          cpus[n_cpus++] = i;
+    } else {
+      g_warning ("could not read the affinity mask: %s", g_strerror (errno));
+      n_cpus = g_get_num_processors ();
+      cpus = g_new (gint, n_cpus);
+      for (i = 0; i < (int) n_cpus; i++)
+        cpus[i] = i;
+    }
+  }
+
+  /* task loops run for as long as their pipeline does, so the pool
+   * cannot be capped without starving sessions; only the idle threads
+   * are bounded */
+  shared = g_thread_pool_new (run_job, NULL, -1, FALSE, NULL);
+  g_thread_pool_set_max_unused_threads (n_cpus);
+  pools = g_new0 (PinnedPool*, n_cpus);
+
+  g_once_init_leave (&initialized, 1);
+}
+
+/* The pool handle for a core, shared by all sessions placed on it */
+GstTaskPool*
+task_pool_get (int cpu)
+{
+  static GMutex lock;
+  PinnedPool *pool;
+
+  task_pool_init ();
+  cpu = (guint) cpu % n_cpus;
+
+  g_mutex_lock (&lock);
+  if (!pools[cpu]) {
+    pools[cpu] = g_object_new (pinned_pool_get_type (), NULL);
+    pools[cpu]->cpu = cpu;
+  }
+  pool = gst_object_ref (pools[cpu]);
+  g_mutex_unlock (&lock);
+
+  return GST_TASK_POOL (pool);
+}
+
+/* Round robin placement for sessions that do not ask for a core */
+int
+task_pool_next_cpu (void)
+{
+  static gint next = 0;
+
+  task_pool_init ();
+  return (guint) g_atomic_int_add (&next, 1) % n_cpus;
+}
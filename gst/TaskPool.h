@@ -0,0 +1,18 @@
+/* 
+ * Copyright (C) 2017 Vikram Fugro
+ *
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#ifndef __TASK_POOL_H__
+#define __TASK_POOL_H__
+
+#include <gst/gst.h>
+
+GstTaskPool*    task_pool_get (int);
+int             task_pool_next_cpu (void);
+void            task_pool_pin (int);
+
+#endif
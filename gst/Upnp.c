@@ -11,6 +11,7 @@
 #include <libgupnp/gupnp-control-point.h>
 #include <gst/gst.h>
 #include <libxml/tree.h>
+#include <libxml/parser.h>
 
 #include <assert.h>
 #include <signal.h>
@@ -26,44 +27,84 @@
 #include <errno.h>
 
 #include "Upnp.h"
+#include "Profile.h"
 
 #define MEDIA_RENDERER "urn:schemas-upnp-org:device:MediaRenderer:1"
 #define CONNECTION_MANAGER "urn:schemas-upnp-org:service:ConnectionManager"
 #define AV_TRANSPORT "urn:schemas-upnp-org:service:AVTransport"
 #define RENDERING_CONTROL "urn:schemas-upnp-org:service:RenderingControl"
 
+#define ACTION_MAX_IN_FLIGHT  1
+#define ACTION_TIMEOUT_MS     4000
+#define ACTION_RETRIES        3
+#define ACTION_BACKOFF_MS     250
+/* bucket i counts actions answered in less than 2^i ms, the last one
+ * everything slower */
+#define LATENCY_BUCKETS       14
+
+/* renderers known from earlier runs are usable right away and dropped
+ * again unless SSDP confirms them within this many seconds */
+#define CACHE_FILE            "renderers.ini"
+#define CACHE_VALIDATE_S      30
+
 
 typedef enum
 {
   EV_STOP = 0,
   EV_SCAN,
-  EV_PLAY
+  EV_PLAY,
+  EV_PLAY_GROUP
 } PlaybackCmd;
 
-typedef enum
-{
-  PLAYBACK_STATE_UNKNOWN,
-  PLAYBACK_STATE_TRANSITIONING,
-  PLAYBACK_STATE_STOPPED,
-  PLAYBACK_STATE_PAUSED,
-  PLAYBACK_STATE_PLAYING
-} PlaybackState;
-
-
 typedef struct
 {
   gpointer data1;
   gpointer data2;
+  gpointer data3;
   PlaybackCmd type;
 } cmd;
 
 typedef struct
 {
-  void (*callback) (char*);
+  void (*callback) (char*, gboolean, gpointer);
+  gpointer user_data;
   GUPnPDIDLLiteResource *resource;
   gchar* target;
 } SetAVTransportURIData;
 
+typedef struct
+{
+  GPtrArray *ready;
+  guint      pending;
+  guint      timeout_id;
+  gboolean   fired;
+} GroupPlay;
+
+typedef struct
+{
+  gchar                   *udn;
+  gchar                   *name;
+  GList                   *names;
+  GList                   *values;
+  GUPnPServiceProxyAction *action;
+  guint                    timer_id;
+  gint                     attempt;
+  gint64                   started;
+  void (*done) (char*, gboolean, gpointer);
+  gpointer                 user_data;
+} QueuedAction;
+
+typedef struct
+{
+  guint64 count;
+  guint64 failures;
+  guint64 retries;
+  guint64 timeouts;
+  guint64 coalesced;
+  guint64 total_ms;
+  guint64 buckets[LATENCY_BUCKETS];
+} ActionStats;
+
 typedef struct
 {
   GUPnPDeviceProxy  *proxy;
@@ -72,13 +113,25 @@ typedef struct
   gchar* sink_protocol_info;
   PlaybackState state;
   gchar* name;
+  GQueue pending;
+  GList* in_flight;
+  guint n_in_flight;
+  GHashTable* stats;
+  gboolean verified;
 } dmr;
 
 static GstAtomicQueue* aqueue;
+static GstAtomicQueue* evqueue;
 static GRecMutex evlock;
 static GList* dmrList = NULL;
 static GUPnPControlPoint *dmr_cp = NULL;
 static GUPnPContextManager *context_manager;
+static GKeyFile *cache;
+static gchar *cache_path;
+
+static void action_queue_flush (dmr *c);
+static void action_stats_free (gpointer data);
+static void cache_store (dmr *c);
 
 static PlaybackState
 state_name_to_state (const char *state_name)
@@ -100,6 +153,28 @@ state_name_to_state (const char *state_name)
   return state;
 }
 
+static void
+push_renderer_event (RendererEventType type, PlaybackState state,
+                     const char *udn)
+{
+  struct RendererEvent* ev = g_new0 (struct RendererEvent, 1);
+  ev->Type = type;
+  ev->State = state;
+  g_strlcpy (ev->Udn, udn, sizeof (ev->Udn));
+  gst_atomic_queue_push (evqueue, ev);
+}
+
+static void
+set_renderer_state (dmr *c, const char *udn, PlaybackState state)
+{
+  if (c->state == state)
+    return;
+
+  g_print ("DMR %s state %d -> %d\n", udn, c->state, state);
+  c->state = state;
+  push_renderer_event (RENDERER_STATE, state, udn);
+}
+
 static void
 g_value_free (gpointer data)
 {
@@ -251,11 +326,57 @@ find_compat_res_from_metadata (const char *metadata, char *target)
   return rdata.resource;
 }
 
+static void
+last_change_cb (GUPnPServiceProxy *av_transport,
+                const char        *variable,
+                GValue            *value,
+                gpointer           user_data)
+{
+  GUPnPLastChangeParser *parser;
+  const gchar           *last_change;
+  const gchar           *udn;
+  gchar                 *state_name = NULL;
+  GError                *error = NULL;
+
+  last_change = g_value_get_string (value);
+  if (last_change == NULL)
+    return;
+
+  udn = gupnp_service_info_get_udn (GUPNP_SERVICE_INFO (av_transport));
+
+  parser = gupnp_last_change_parser_new ();
+  if (!gupnp_last_change_parser_parse_last_change (parser,
+        0,
+        last_change,
+        &error,
+        "TransportState",
+        G_TYPE_STRING,
+        &state_name,
+        NULL)) {
+    g_warning ("Failed to parse LastChange from media renderer"
+        " '%s':%s\n",
+        udn,
+        error->message);
+    g_error_free (error);
+  } else if (state_name) {
+    dmr* c;
+    g_rec_mutex_lock (&evlock);
+    if (find_renderer (udn, &c)) {
+      set_renderer_state (c, udn, state_name_to_state (state_name));
+    }
+    g_rec_mutex_unlock (&evlock);
+  }
+
+  g_free (state_name);
+  g_object_unref (parser);
+}
+
 static void
 append_media_renderer_to_list (GUPnPDeviceProxy  *proxy,
                                GUPnPServiceProxy *av_transport,
                                GUPnPServiceProxy *rendering_control,
-                               const char        *udn)
+                               const char        *udn,
+                               gboolean           cached)
 {
   GUPnPDeviceInfo  *info;
   char             *name;
@@ -273,11 +394,27 @@ append_media_renderer_to_list (GUPnPDeviceProxy  *proxy,
   c->proxy = g_object_ref(G_OBJECT(proxy));
   c->av_transport = g_object_ref(G_OBJECT(av_transport));
   c->rendering_control = g_object_ref(G_OBJECT(rendering_control));
+  c->sink_protocol_info = NULL;
   c->state = PLAYBACK_STATE_UNKNOWN;
+  g_queue_init (&c->pending);
+  c->in_flight = NULL;
+  c->n_in_flight = 0;
+  c->stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      action_stats_free);
+  c->verified = !cached;
+  if (cached)
+    c->sink_protocol_info = g_key_file_get_string (cache, udn,
+        "SinkProtocolInfo", NULL);
 
   dmrList = g_list_append(dmrList, c); 
+  push_renderer_event (RENDERER_ADDED, PLAYBACK_STATE_UNKNOWN, udn);
   g_rec_mutex_unlock (&evlock);
  
+  gupnp_service_proxy_add_notify (av_transport,
+      "LastChange",
+      G_TYPE_STRING,
+      last_change_cb,
+      NULL);
   gupnp_service_proxy_set_subscribed (av_transport, TRUE);
   gupnp_service_proxy_set_subscribed (rendering_control, TRUE);
 
@@ -314,9 +451,14 @@ get_protocol_info_cb (GUPnPServiceProxy       *cm,
 
   if (sink_protocol_info) {
     dmr* c;
+    g_rec_mutex_lock (&evlock);
     if (find_renderer (udn, &c)) {
+      g_free (c->sink_protocol_info);
       c->sink_protocol_info = g_strdup(sink_protocol_info);
+      if (c->verified)
+        cache_store (c);
     }
+    g_rec_mutex_unlock (&evlock);
     g_free(sink_protocol_info);
   }
 
@@ -354,9 +496,11 @@ get_transport_info_cb (GUPnPServiceProxy       *av_transport,
 
   if (state_name) {
     dmr* c;
+    g_rec_mutex_lock (&evlock);
     if (find_renderer (udn, &c)) {
-      c->state = state_name_to_state (state_name); 
+      set_renderer_state (c, udn, state_name_to_state (state_name));
     } 
+    g_rec_mutex_unlock (&evlock);
     g_free (state_name);
   }
 
@@ -364,13 +508,49 @@ return_point:
   g_object_unref (av_transport);
 }
 
+/* SSDP found a renderer that was loaded from the cache: from now on it
+ * is trusted, and talked to through the live proxies if it moved */
 static void
-add_media_renderer (GUPnPDeviceProxy *proxy)
+verify_cached_renderer (dmr *c, GUPnPDeviceProxy *proxy,
+    GUPnPServiceProxy *av_transport, GUPnPServiceProxy *rendering_control)
+{
+  const char *udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
+
+  g_rec_mutex_lock (&evlock);
+  c->verified = TRUE;
+  if (g_strcmp0 (gupnp_device_info_get_location (GUPNP_DEVICE_INFO (proxy)),
+        gupnp_device_info_get_location (GUPNP_DEVICE_INFO (c->proxy)))) {
+    g_print ("DMR %s moved, switching to its new location\n", udn);
+    gupnp_service_proxy_remove_notify (c->av_transport,
+        "LastChange",
+        last_change_cb,
+        NULL);
+    gupnp_service_proxy_set_subscribed (c->av_transport, FALSE);
+    g_object_unref (c->proxy);
+    g_object_unref (c->av_transport);
+    g_object_unref (c->rendering_control);
+    c->proxy = g_object_ref (G_OBJECT (proxy));
+    c->av_transport = g_object_ref (G_OBJECT (av_transport));
+    c->rendering_control = g_object_ref (G_OBJECT (rendering_control));
+    gupnp_service_proxy_add_notify (av_transport,
+        "LastChange",
+        G_TYPE_STRING,
+        last_change_cb,
+        NULL);
+    gupnp_service_proxy_set_subscribed (av_transport, TRUE);
+    gupnp_service_proxy_set_subscribed (rendering_control, TRUE);
+  }
+  g_rec_mutex_unlock (&evlock);
+}
+
+static void
+add_media_renderer (GUPnPDeviceProxy *proxy, gboolean cached)
 {
   const char        *udn;
   GUPnPServiceProxy *cm;
   GUPnPServiceProxy *av_transport;
   GUPnPServiceProxy *rendering_control;
+  dmr               *c;
 
   udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
   if (udn == NULL) {
@@ -392,17 +572,22 @@ add_media_renderer (GUPnPDeviceProxy *proxy)
   if (rendering_control == NULL)
     goto no_rendering_control;
 
-  if (!find_renderer (udn, NULL))
+  if (!find_renderer (udn, &c))
     append_media_renderer_to_list (proxy,
         av_transport,
         rendering_control,
-        udn);
-
-  gupnp_service_proxy_begin_action (g_object_ref (G_OBJECT(cm)),
-      "GetProtocolInfo",
-      get_protocol_info_cb,
-      NULL,
-      NULL);
+        udn,
+        cached);
+  else if (!cached && !c->verified)
+    verify_cached_renderer (c, proxy, av_transport, rendering_control);
+
+  /* a cached renderer comes with its protocol info */
+  if (!cached)
+    gupnp_service_proxy_begin_action (g_object_ref (G_OBJECT(cm)),
+        "GetProtocolInfo",
+        get_protocol_info_cb,
+        NULL,
+        NULL);
 
   gupnp_service_proxy_begin_action (g_object_ref (G_OBJECT(av_transport)),
       "GetTransportInfo",
@@ -423,7 +608,7 @@ static void
 dmr_proxy_available_cb (GUPnPControlPoint *cp,
                         GUPnPDeviceProxy  *proxy)
 {
-  add_media_renderer (proxy);
+  add_media_renderer (proxy, FALSE);
 }
 
 static void
@@ -440,13 +625,22 @@ remove_media_renderer (GUPnPDeviceProxy *proxy)
 
   if (list) {
     dmr* c = (dmr*)list->data;
+    gupnp_service_proxy_remove_notify (c->av_transport,
+        "LastChange",
+        last_change_cb,
+        NULL);
+    gupnp_service_proxy_set_subscribed (c->av_transport, FALSE);
+    push_renderer_event (RENDERER_GONE, PLAYBACK_STATE_UNKNOWN,
+        gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+    dmrList = g_list_remove_link (dmrList, list);
+    action_queue_flush (c);
+    g_hash_table_destroy (c->stats);
     g_free(c->name);
     g_free(c->sink_protocol_info);
     g_object_unref (c->proxy);
     g_object_unref (c->av_transport);
     g_object_unref (c->rendering_control);
     g_free(c);
-    dmrList = g_list_remove_link (dmrList, list);
     g_list_free (list);
   }
   
@@ -460,6 +654,171 @@ dmr_proxy_unavailable_cb (GUPnPControlPoint *cp,
   remove_media_renderer (proxy);
 }
 
+static void
+cache_save (void)
+{
+  GError *error = NULL;
+  gchar *dir = g_path_get_dirname (cache_path);
+
+  g_mkdir_with_parents (dir, 0700);
+  if (!g_key_file_save_to_file (cache, cache_path, &error)) {
+    g_warning ("could not write %s: %s", cache_path, error->message);
+    g_error_free (error);
+  }
+  g_free (dir);
+}
+
+/* Remembers what it takes to talk to a renderer without fetching its
+ * description again: where it lives and the description itself, which
+ * also carries the service control and event URLs */
+static void
+cache_store (dmr *c)
+{
+  GUPnPDeviceInfo *info = GUPNP_DEVICE_INFO (c->proxy);
+  const char *udn = gupnp_device_info_get_udn (info);
+  GUPnPXMLDoc *doc = NULL;
+  xmlChar *xml = NULL;
+  gchar *base;
+  int len = 0;
+
+  g_object_get (c->proxy, "document", &doc, NULL);
+  if (!doc)
+    return;
+
+  xmlDocDumpMemory (doc->doc, &xml, &len);
+  base = soup_uri_to_string ((SoupURI*) gupnp_device_info_get_url_base (info),
+      FALSE);
+
+  g_key_file_set_string (cache, udn, "Name", c->name);
+  g_key_file_set_string (cache, udn, "Location",
+      gupnp_device_info_get_location (info));
+  g_key_file_set_string (cache, udn, "UrlBase", base);
+  g_key_file_set_string (cache, udn, "Description", (const char*) xml);
+  if (c->sink_protocol_info)
+    g_key_file_set_string (cache, udn, "SinkProtocolInfo",
+        c->sink_protocol_info);
+  cache_save ();
+
+  g_free (base);
+  xmlFree (xml);
+  g_object_unref (doc);
+}
+
+static xmlNode*
+find_device_element (xmlNode *node, const char *udn)
+{
+  xmlNode *child, *found;
+
+  for (; node != NULL; node = node->next) {
+    if (node->type != XML_ELEMENT_NODE)
+      continue;
+
+    if (!xmlStrcmp (node->name, BAD_CAST "device")) {
+      for (child = node->children; child != NULL; child = child->next) {
+        xmlChar *text;
+        gboolean match;
+
+        if (child->type != XML_ELEMENT_NODE ||
+            xmlStrcmp (child->name, BAD_CAST "UDN"))
+          continue;
+        text = xmlNodeGetContent (child);
+        match = text && !strcmp (g_strstrip ((gchar*) text), udn);
+        xmlFree (text);
+        if (match)
+          return node;
+      }
+    }
+
+    if ((found = find_device_element (node->children, udn)))
+      return found;
+  }
+
+  return NULL;
+}
+
+static gboolean
+cache_validate_cb (gpointer data)
+{
+  GList *list, *stale = NULL;
+
+  g_rec_mutex_lock (&evlock);
+  for (list = dmrList; list != NULL; list = list->next) {
+    dmr *c = (dmr*)list->data;
+
+    if (!c->verified)
+      stale = g_list_prepend (stale, g_object_ref (c->proxy));
+  }
+  g_rec_mutex_unlock (&evlock);
+
+  for (list = stale; list != NULL; list = list->next) {
+    GUPnPDeviceProxy *proxy = list->data;
+
+    g_print ("cached DMR %s did not show up, forgetting it\n",
+        gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+    g_key_file_remove_group (cache,
+        gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)), NULL);
+    remove_media_renderer (proxy);
+  }
+  if (stale)
+    cache_save ();
+  g_list_free_full (stale, g_object_unref);
+
+  return FALSE;
+}
+
+/* Brings back the renderers of earlier runs from their cached
+ * descriptions, nothing goes over the network until they are used */
+static void
+cache_load (GUPnPContext *context)
+{
+  GUPnPResourceFactory *factory;
+  gchar **udns, **u;
+
+  factory = gupnp_control_point_get_resource_factory (dmr_cp);
+  udns = g_key_file_get_groups (cache, NULL);
+
+  for (u = udns; *u; u++) {
+    gchar *location = g_key_file_get_string (cache, *u, "Location", NULL);
+    gchar *base = g_key_file_get_string (cache, *u, "UrlBase", NULL);
+    gchar *desc = g_key_file_get_string (cache, *u, "Description", NULL);
+    GUPnPDeviceProxy *proxy;
+    GUPnPXMLDoc *doc;
+    SoupURI *url_base;
+    xmlNode *element;
+    xmlDoc *xdoc = NULL;
+
+    if (location && desc)
+      xdoc = xmlReadMemory (desc, strlen (desc), location, NULL,
+          XML_PARSE_NONET);
+    element = xdoc ? find_device_element (xmlDocGetRootElement (xdoc), *u)
+        : NULL;
+    url_base = soup_uri_new (base ? base : location);
+
+    if (element && url_base) {
+      doc = gupnp_xml_doc_new (xdoc);
+      proxy = gupnp_resource_factory_create_device_proxy (factory, context,
+          doc, element, *u, location, url_base);
+      g_print ("cached DMR %s\n", *u);
+      add_media_renderer (proxy, TRUE);
+      g_object_unref (proxy);
+      g_object_unref (doc);
+    } else {
+      g_key_file_remove_group (cache, *u, NULL);
+      if (xdoc)
+        xmlFreeDoc (xdoc);
+    }
+
+    if (url_base)
+      soup_uri_free (url_base);
+    g_free (location);
+    g_free (base);
+    g_free (desc);
+  }
+
+  g_strfreev (udns);
+  g_timeout_add_seconds (CACHE_VALIDATE_S, cache_validate_cb, NULL);
+}
+
 static void
 on_context_available (GUPnPContextManager *context_manager,
                       GUPnPContext        *context,
@@ -478,6 +837,16 @@ on_context_available (GUPnPContextManager *context_manager,
       G_CALLBACK (dmr_proxy_unavailable_cb),
       NULL);
 
+  /* only the first network gets the cached renderers */
+  {
+    static gboolean loaded = FALSE;
+
+    if (!loaded) {
+      loaded = TRUE;
+      cache_load (context);
+    }
+  }
+
   gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (dmr_cp),
       TRUE);
 
@@ -502,35 +871,252 @@ init_upnp (int port)
   return TRUE;
 }
 
+static ActionStats *
+action_stats_get (dmr *c, const char *name)
+{
+  ActionStats *st = g_hash_table_lookup (c->stats, name);
+
+  if (!st) {
+    st = g_slice_new0 (ActionStats);
+    g_hash_table_insert (c->stats, g_strdup (name), st);
+  }
+
+  return st;
+}
+
 static void
-av_transport_action_cb (GUPnPServiceProxy       *av_transport,
-                        GUPnPServiceProxyAction *action,
-                        gpointer                 user_data)
+action_stats_free (gpointer data)
 {
-  const char *action_name;
-  GError *error;
+  g_slice_free (ActionStats, data);
+}
 
-  action_name = (const char *) user_data;
+static void
+action_stats_record (dmr *c, QueuedAction *a, gboolean ok)
+{
+  ActionStats *st = action_stats_get (c, a->name);
+  gint64 ms = (g_get_monotonic_time () - a->started) / 1000;
+  guint bucket = 0;
+
+  while (bucket < LATENCY_BUCKETS - 1 && ms >= (1 << bucket))
+    bucket++;
+
+  st->count++;
+  st->total_ms += ms;
+  st->buckets[bucket]++;
+  if (!ok)
+    st->failures++;
+}
 
-  error = NULL;
-  if (!gupnp_service_proxy_end_action (av_transport,
-        action,
-        &error,
-        NULL)) {
-    const char *udn;
+static void
+queued_action_free (QueuedAction *a)
+{
+  if (a->timer_id)
+    g_source_remove (a->timer_id);
+  g_free (a->udn);
+  g_free (a->name);
+  g_list_free_full (a->names, g_free);
+  g_list_free_full (a->values, g_value_free);
+  g_slice_free (QueuedAction, a);
+}
+
+static void
+queued_action_complete (QueuedAction *a, gboolean ok)
+{
+  if (a->done)
+    a->done (a->udn, ok, a->user_data);
+  queued_action_free (a);
+}
+
+static void action_queue_dispatch (dmr *c);
 
-    udn = gupnp_service_info_get_udn
-      (GUPNP_SERVICE_INFO (av_transport));
+static void
+action_send_cb (GUPnPServiceProxy       *av_transport,
+                GUPnPServiceProxyAction *action,
+                gpointer                 user_data);
+
+static gboolean
+action_retry_cb (gpointer user_data)
+{
+  QueuedAction *a = (QueuedAction*) user_data;
+  dmr *c;
+
+  a->timer_id = 0;
 
+  g_rec_mutex_lock (&evlock);
+  if (find_renderer (a->udn, &c)) {
+    c->in_flight = g_list_remove (c->in_flight, a);
+    c->n_in_flight--;
+    g_queue_push_head (&c->pending, a);
+    action_queue_dispatch (c);
+  }
+  g_rec_mutex_unlock (&evlock);
+
+  return FALSE;
+}
+
+/* Either hand the action back to its owner or, while it has retries
+ * left, keep its in-flight slot through the backoff so nothing queued
+ * behind it can overtake it. */
+static void
+action_finish (dmr *c, QueuedAction *a, gboolean ok, const char *reason)
+{
+  a->action = NULL;
+  action_stats_record (c, a, ok);
+
+  if (!ok && a->attempt < ACTION_RETRIES) {
+    guint backoff = ACTION_BACKOFF_MS << a->attempt;
+
+    a->attempt++;
+    action_stats_get (c, a->name)->retries++;
+    g_warning ("action '%s' to '%s' failed (%s), retry %d in %ums",
+        a->name, a->udn, reason, a->attempt, backoff);
+    a->timer_id = g_timeout_add (backoff, action_retry_cb, a);
+    return;
+  }
+
+  if (!ok)
     g_warning ("Failed to send action '%s' to '%s': %s",
-        action_name,
-        udn,
-        error->message);
+        a->name, a->udn, reason);
+
+  c->in_flight = g_list_remove (c->in_flight, a);
+  c->n_in_flight--;
+  queued_action_complete (a, ok);
+  action_queue_dispatch (c);
+}
+
+static gboolean
+action_timeout_cb (gpointer user_data)
+{
+  QueuedAction *a = (QueuedAction*) user_data;
+  dmr *c;
+
+  a->timer_id = 0;
+
+  g_rec_mutex_lock (&evlock);
+  if (find_renderer (a->udn, &c)) {
+    gupnp_service_proxy_cancel_action (c->av_transport, a->action);
+    action_stats_get (c, a->name)->timeouts++;
+    action_finish (c, a, FALSE, "timed out");
+  }
+  g_rec_mutex_unlock (&evlock);
+
+  return FALSE;
+}
+
+static void
+action_send_cb (GUPnPServiceProxy       *av_transport,
+                GUPnPServiceProxyAction *action,
+                gpointer                 user_data)
+{
+  QueuedAction *a = (QueuedAction*) user_data;
+  GError *error = NULL;
+  gboolean ok;
+  dmr *c;
+
+  ok = gupnp_service_proxy_end_action (av_transport,
+      action,
+      &error,
+      NULL);
+
+  if (a->timer_id) {
+    g_source_remove (a->timer_id);
+    a->timer_id = 0;
+  }
+
+  g_rec_mutex_lock (&evlock);
+  if (find_renderer (a->udn, &c))
+    action_finish (c, a, ok, ok ? NULL : error->message);
+  else
+    queued_action_complete (a, FALSE);
+  g_rec_mutex_unlock (&evlock);
 
+  if (error)
     g_error_free (error);
+}
+
+static void
+action_queue_dispatch (dmr *c)
+{
+  while (c->n_in_flight < ACTION_MAX_IN_FLIGHT &&
+      !g_queue_is_empty (&c->pending)) {
+    QueuedAction *a = g_queue_pop_head (&c->pending);
+
+    c->in_flight = g_list_append (c->in_flight, a);
+    c->n_in_flight++;
+
+    a->started = g_get_monotonic_time ();
+    a->action = gupnp_service_proxy_begin_action_list (c->av_transport,
+        a->name,
+        a->names,
+        a->values,
+        action_send_cb,
+        a);
+    a->timer_id = g_timeout_add (ACTION_TIMEOUT_MS, action_timeout_cb, a);
   }
+}
 
-  g_object_unref (av_transport);
+static gboolean
+action_supersedes (const char *name, QueuedAction *queued)
+{
+  /* a Stop makes any transport setup or Play not yet sent pointless */
+  if (!strcmp (name, "Stop"))
+    return !strcmp (queued->name, "Play") ||
+        !strcmp (queued->name, "SetAVTransportURI") ||
+        !strcmp (queued->name, "Stop");
+
+  return !strcmp (name, "Play") && !strcmp (queued->name, "Play");
+}
+
+static void
+action_queue_push (dmr *c, QueuedAction *a)
+{
+  GList *l, *next;
+
+  for (l = c->pending.head; l != NULL; l = next) {
+    QueuedAction *q = l->data;
+
+    next = l->next;
+    if (action_supersedes (a->name, q)) {
+      g_print ("coalescing '%s' into '%s' for %s\n", q->name, a->name, a->udn);
+      g_queue_delete_link (&c->pending, l);
+      action_stats_get (c, q->name)->coalesced++;
+      queued_action_complete (q, FALSE);
+    }
+  }
+
+  /* a retry waiting out its backoff is as good as pending */
+  for (l = c->in_flight; l != NULL; l = next) {
+    QueuedAction *q = l->data;
+
+    next = l->next;
+    if (q->action == NULL && action_supersedes (a->name, q)) {
+      c->in_flight = g_list_delete_link (c->in_flight, l);
+      c->n_in_flight--;
+      action_stats_get (c, q->name)->coalesced++;
+      queued_action_complete (q, FALSE);
+    }
+  }
+
+  g_queue_push_tail (&c->pending, a);
+  action_queue_dispatch (c);
+}
+
+static void
+action_queue_flush (dmr *c)
+{
+  QueuedAction *a;
+
+  while ((a = g_queue_pop_head (&c->pending)))
+    queued_action_complete (a, FALSE);
+
+  while (c->in_flight) {
+    a = c->in_flight->data;
+    c->in_flight = g_list_delete_link (c->in_flight, c->in_flight);
+    if (a->action)
+      gupnp_service_proxy_cancel_action (c->av_transport, a->action);
+    queued_action_complete (a, FALSE);
+  }
+  c->n_in_flight = 0;
 }
 
 static GList *
@@ -567,33 +1153,46 @@ create_av_transport_args (char **additional_args, GList **out_values)
 }
 
 static void
-av_transport_send_action (char *action,
-                          char *additional_args[],
-                          char *target)
+av_transport_queue_action (const char *action,
+                           char *additional_args[],
+                           char *target,
+                           void (*done) (char*, gboolean, gpointer),
+                           gpointer user_data)
 {
-  GUPnPServiceProxy *av_transport;
-  GList             *names, *values;
+  QueuedAction *a;
+  dmr *c;
 
-  av_transport = get_selected_av_transport (NULL, target);
-  if (av_transport == NULL) {
+  g_rec_mutex_lock (&evlock);
+  if (!find_renderer (target, &c)) {
+    g_rec_mutex_unlock (&evlock);
     g_warning ("No renderer selected");
+    if (done)
+      done (target, FALSE, user_data);
     return;
   }
 
-  names = create_av_transport_args (additional_args, &values);
+  a = g_slice_new0 (QueuedAction);
+  a->udn = g_strdup (target);
+  a->name = g_strdup (action);
+  a->names = create_av_transport_args (additional_args, &a->values);
+  a->done = done;
+  a->user_data = user_data;
 
-  gupnp_service_proxy_begin_action_list (av_transport,
-      action,
-      names,
-      values,
-      av_transport_action_cb,
-      (char *) action);
-  g_list_free_full (names, g_free);
-  g_list_free_full (values, g_value_free);
+  action_queue_push (c, a);
+  g_rec_mutex_unlock (&evlock);
+}
+
+static void
+av_transport_send_action (char *action,
+                          char *additional_args[],
+                          char *target)
+{
+  av_transport_queue_action (action, additional_args, target, NULL, NULL);
 }
 
 static SetAVTransportURIData *
-set_av_transport_uri_data_new (void (*callback) (char*),
+set_av_transport_uri_data_new (void (*callback) (char*, gboolean, gpointer),
+                               gpointer user_data,
                                GUPnPDIDLLiteResource *resource,
                                gchar *target)
 {
@@ -601,6 +1200,7 @@ set_av_transport_uri_data_new (void (*callback) (char*),
 
   data = g_slice_new (SetAVTransportURIData);
   data->callback = callback;
+  data->user_data = user_data;
   data->target = g_strdup (target);
   data->resource = resource; /* Steal the ref */
 
@@ -616,36 +1216,23 @@ set_av_transport_uri_data_free (SetAVTransportURIData *data)
 }
 
 static void
-set_av_transport_uri_cb (GUPnPServiceProxy       *av_transport,
-                         GUPnPServiceProxyAction *action,
-                         gpointer                 user_data)
+set_av_transport_uri_done (char *target, gboolean ok, gpointer user_data)
 {
   SetAVTransportURIData *data;
-  GError                *error;
 
   data = (SetAVTransportURIData *) user_data;
 
-  error = NULL;
-  if (gupnp_service_proxy_end_action (av_transport,
-        action,
-        &error,
-        NULL)) {
-    if (data->callback) {
-      data->callback (data->target);
-    }
-  } else {
-    const char *udn;
-    udn = gupnp_service_info_get_udn
-      (GUPNP_SERVICE_INFO (av_transport));
-    g_warning ("Failed to set URI '%s' on %s: %s",
+  if (!ok) {
+    g_warning ("Failed to set URI '%s' on %s",
         gupnp_didl_lite_resource_get_uri (data->resource),
-        udn,
-        error->message);
-    g_error_free (error);
+        target);
+  }
+
+  if (data->callback) {
+    data->callback (data->target, ok, data->user_data);
   }
 
   set_av_transport_uri_data_free (data);
-  g_object_unref (av_transport);
 }
 
 static void
@@ -655,51 +1242,46 @@ play (char *target)
   av_transport_send_action ("Play", args, target);
 }
 
+static void
+play_on_uri_set (char *target, gboolean ok, gpointer user_data)
+{
+  if (ok)
+    play (target);
+}
+
 static void
 set_av_transport_uri (const char *metadata,
-                       void (*callback) (char*), char* rtarget)
+                       void (*callback) (char*, gboolean, gpointer),
+                       gpointer user_data, char* rtarget)
 {
-  GUPnPServiceProxy     *av_transport;
   SetAVTransportURIData *data;
   GUPnPDIDLLiteResource *resource;
-  const char            *uri;
-
-  av_transport = get_selected_av_transport (NULL, rtarget);
-  if (av_transport == NULL) {
-    g_warning ("No renderer selected");
-    return;
-  }
+  char                  *args[5];
 
   resource = find_compat_res_from_metadata (metadata, rtarget);
   if (resource == NULL) {
     g_warning ("no compatible URI found.");
 
-    g_object_unref (av_transport);
+    if (callback)
+      callback (rtarget, FALSE, user_data);
 
     return;
   }
 
-  data = set_av_transport_uri_data_new (callback, resource, rtarget);
-  uri = gupnp_didl_lite_resource_get_uri (resource);
+  data = set_av_transport_uri_data_new (callback, user_data, resource, rtarget);
 
-  gupnp_service_proxy_begin_action (av_transport,
-      "SetAVTransportURI",
-      set_av_transport_uri_cb,
-      data,
-      "InstanceID",
-      G_TYPE_UINT,
-      0,
-      "CurrentURI",
-      G_TYPE_STRING,
-      uri,
-      "CurrentURIMetaData",
-      G_TYPE_STRING,
-      metadata,
-      NULL);
+  args[0] = "CurrentURI";
+  args[1] = (char *) gupnp_didl_lite_resource_get_uri (resource);
+  args[2] = "CurrentURIMetaData";
+  args[3] = (char *) metadata;
+  args[4] = NULL;
+
+  av_transport_queue_action ("SetAVTransportURI", args, rtarget,
+      set_av_transport_uri_done, data);
 }
 
-static void
-up_ev_play(char* rtarget, char* url) 
+static gchar*
+build_didl (char* url, const char* pn)
 {
   /*char r[1500];
     FILE* fp = fopen ("./tmp.ddl", "r");
@@ -715,6 +1297,10 @@ up_ev_play(char* rtarget, char* url)
   //struct ifaddrs *myaddrs, *ifa;
   //struct sockaddr_in *s4;
   char buf[512];
+  const StreamProfile *profile = profile_find (pn);
+
+  if (!profile)
+    profile = profile_default ();
 
   writer = gupnp_didl_lite_writer_new (NULL);
   item = GUPNP_DIDL_LITE_OBJECT (gupnp_didl_lite_writer_add_item (writer));
@@ -752,8 +1338,8 @@ up_ev_play(char* rtarget, char* url)
   info = gupnp_protocol_info_new ();
   gupnp_protocol_info_set_protocol (info, "http-get");
   gupnp_protocol_info_set_network (info, "*");
-  gupnp_protocol_info_set_mime_type (info, "video/mp4");
-  gupnp_protocol_info_set_dlna_profile(info, "AVC_MP4_BL_CIF15_AAC_520");
+  gupnp_protocol_info_set_mime_type (info, profile->mime);
+  gupnp_protocol_info_set_dlna_profile(info, profile->name);
   gupnp_protocol_info_set_dlna_operation (info, GUPNP_DLNA_OPERATION_NONE);
   gupnp_protocol_info_set_dlna_conversion (info, GUPNP_DLNA_CONVERSION_TRANSCODED);
   gupnp_protocol_info_set_dlna_flags (info,
@@ -763,8 +1349,8 @@ up_ev_play(char* rtarget, char* url)
       GUPNP_DLNA_FLAGS_CONNECTION_STALL|GUPNP_DLNA_FLAGS_DLNA_V15);
 
   gupnp_didl_lite_resource_set_protocol_info (res, info);
-  gupnp_didl_lite_resource_set_width (res, 320);
-  gupnp_didl_lite_resource_set_height (res, 240);
+  gupnp_didl_lite_resource_set_width (res, profile->width);
+  gupnp_didl_lite_resource_set_height (res, profile->height);
 
   g_object_unref (info);
   g_object_unref (res);
@@ -780,19 +1366,133 @@ up_ev_play(char* rtarget, char* url)
   g_object_unref (item);
   g_object_unref (writer);
 
+  return r;
+}
+
+static void
+up_ev_play(char* rtarget, char* url, char* pn) 
+{
+  gchar *r = build_didl (url, pn);
+
   printf ("%s\n", r);
-  set_av_transport_uri(r, play, rtarget); 
+  set_av_transport_uri(r, play_on_uri_set, NULL, rtarget); 
 
   g_free(r);
 }
 
+static void
+group_play_fire (GroupPlay *g)
+{
+  guint i;
+
+  if (g->fired)
+    return;
+
+  g->fired = TRUE;
+  if (g->timeout_id) {
+    g_source_remove (g->timeout_id);
+    g->timeout_id = 0;
+  }
+
+  /* Issue all the Play actions back to back from the same main loop
+   * iteration so the renderers start as close together as possible */
+  g_print ("group play: %u renderer(s) ready\n", g->ready->len);
+  for (i = 0; i < g->ready->len; i++)
+    play (g_ptr_array_index (g->ready, i));
+}
+
+static void
+group_play_maybe_free (GroupPlay *g)
+{
+  if (!g->fired || g->pending > 0 || g->timeout_id)
+    return;
+
+  g_ptr_array_free (g->ready, TRUE);
+  g_slice_free (GroupPlay, g);
+}
+
+static void
+group_uri_set_cb (char *target, gboolean ok, gpointer user_data)
+{
+  GroupPlay *g = (GroupPlay*) user_data;
+
+  if (ok) {
+    if (g->fired) {
+      /* Missed the group start, join in as soon as possible */
+      play (target);
+    } else {
+      g_ptr_array_add (g->ready, g_strdup (target));
+    }
+  }
+
+  g->pending--;
+  if (g->pending == 0)
+    group_play_fire (g);
+  group_play_maybe_free (g);
+}
+
+static gboolean
+group_play_timeout_cb (gpointer data)
+{
+  GroupPlay *g = (GroupPlay*) data;
+
+  g->timeout_id = 0;
+  group_play_fire (g);
+  group_play_maybe_free (g);
+
+  return FALSE;
+}
+
+static void
+up_ev_play_group (char** targets, char* url, char* pn)
+{
+  GroupPlay *g;
+  gchar *r;
+  guint i, n;
+
+  n = g_strv_length (targets);
+  if (n == 0)
+    return;
+
+  r = build_didl (url, pn);
+  printf ("%s\n", r);
+
+  g = g_slice_new0 (GroupPlay);
+  g->ready = g_ptr_array_new_with_free_func (g_free);
+  g->pending = n;
+  g->timeout_id = g_timeout_add_seconds (3, group_play_timeout_cb, g);
+
+  for (i = 0; i < n; i++)
+    set_av_transport_uri (r, group_uri_set_cb, g, targets[i]);
+
+  g_free (r);
+}
+
 void
-up_play (char* target, char *url)
+up_play (char* target, char *url, const char *profile)
 {
   cmd* c = g_new0(cmd, 1);
   c->type = EV_PLAY;
   c->data1 = (void*)g_strdup(target);
   c->data2 = (void*)g_strdup(url);
+  c->data3 = (void*)g_strdup(profile);
+  gst_atomic_queue_push(aqueue, c);
+}
+
+void
+up_play_group (char** targets, int n, char *url, const char *profile)
+{
+  cmd* c = g_new0(cmd, 1);
+  gchar** t = g_new0(gchar*, n + 1);
+  int i;
+
+  for (i = 0; i < n; i++)
+    t[i] = g_strdup (targets[i]);
+
+  c->type = EV_PLAY_GROUP;
+  c->data1 = (void*)t;
+  c->data2 = (void*)g_strdup(url);
+  c->data3 = (void*)g_strdup(profile);
   gst_atomic_queue_push(aqueue, c);
 }
 
@@ -803,21 +1503,15 @@ up_ev_scan ()
   gssdp_resource_browser_rescan (browser);
 }
 
-//char**
+/* The renderers known right now, cached or discovered, without scanning */
 struct Renderer*
-up_scan (int *len)
+up_list (int *len)
 {
   struct Renderer* r = g_new0(struct Renderer, 10);
   //char** arr = g_malloc0 (20 * sizeof(char*));
   GList* list;
   gint i = 0;
 
-  cmd* c = g_new0(cmd, 1);
-  c->type = EV_SCAN;
-  gst_atomic_queue_push(aqueue, c);
-
-  sleep(5);
-  
   g_rec_mutex_lock (&evlock);
  
   for (list = dmrList; list != NULL && i < 10; list = list->next) {
@@ -835,6 +1529,98 @@ up_scan (int *len)
   return r;
 }
 
+//char**
+struct Renderer*
+up_scan (int *len)
+{
+  cmd* c = g_new0(cmd, 1);
+  c->type = EV_SCAN;
+  gst_atomic_queue_push(aqueue, c);
+
+  sleep(5);
+
+  return up_list (len);
+}
+
+char*
+up_sink_protocol_info (const char *udn)
+{
+  char *info = NULL;
+  dmr* c;
+
+  g_rec_mutex_lock (&evlock);
+  if (find_renderer (udn, &c))
+    info = g_strdup (c->sink_protocol_info);
+  g_rec_mutex_unlock (&evlock);
+
+  return info;
+}
+
+/* a JSON string literal, the names come from the renderers themselves */
+static void
+append_json_string (GString *json, const char *str)
+{
+  const char *c;
+
+  g_string_append_c (json, '"');
+  for (c = str ? str : ""; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      g_string_append_printf (json, "\\%c", *c);
+    else if ((guchar) *c < 0x20)
+      g_string_append_printf (json, "\\u%04x", (guchar) *c);
+    else
+      g_string_append_c (json, *c);
+  }
+  g_string_append_c (json, '"');
+}
+
+char*
+up_action_stats (void)
+{
+  GString *json = g_string_new ("{");
+  GList *list;
+
+  g_rec_mutex_lock (&evlock);
+  for (list = dmrList; list != NULL; list = list->next) {
+    dmr *c = (dmr*)list->data;
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean first = TRUE;
+
+    if (list != dmrList)
+      g_string_append_c (json, ',');
+    append_json_string (json,
+        gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (c->proxy)));
+    g_string_append (json, ":{");
+
+    g_hash_table_iter_init (&iter, c->stats);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+      ActionStats *st = (ActionStats*) value;
+      guint i;
+
+      if (!first)
+        g_string_append_c (json, ',');
+      append_json_string (json, (char*) key);
+      g_string_append_printf (json, ":{\"count\":%" G_GUINT64_FORMAT
+          ",\"failures\":%" G_GUINT64_FORMAT ",\"retries\":%" G_GUINT64_FORMAT
+          ",\"timeouts\":%" G_GUINT64_FORMAT ",\"coalesced\":%" G_GUINT64_FORMAT
+          ",\"mean_ms\":%" G_GUINT64_FORMAT ",\"latency_ms\":[",
+          st->count, st->failures, st->retries,
+          st->timeouts, st->coalesced, st->count ? st->total_ms / st->count : 0);
+      for (i = 0; i < LATENCY_BUCKETS; i++)
+        g_string_append_printf (json, "%s%" G_GUINT64_FORMAT, i ? "," : "",
+            st->buckets[i]);
+      g_string_append (json, "]}");
+      first = FALSE;
+    }
+    g_string_append (json, "}");
+  }
+  g_rec_mutex_unlock (&evlock);
+
+  g_string_append (json, "}");
+  return g_string_free (json, FALSE);
+}
+
 static void
 up_ev_stop(char* target) 
 {
@@ -850,6 +1636,19 @@ up_stop (char *target)
   gst_atomic_queue_push(aqueue, c);
 }
 
+int
+up_poll_event (struct RendererEvent *ev)
+{
+  struct RendererEvent* e = gst_atomic_queue_pop (evqueue);
+
+  if (!e)
+    return 0;
+
+  *ev = *e;
+  g_free (e);
+  return 1;
+}
+
 static gboolean
 listener(gpointer udata) 
 {
@@ -866,9 +1665,16 @@ listener(gpointer udata)
     
       case EV_PLAY:
         g_print ("sending play %s %s\n", (char*)c->data1, (char*)c->data2);
-        up_ev_play(c->data1, c->data2);
+        up_ev_play(c->data1, c->data2, c->data3);
         break;
     
+      case EV_PLAY_GROUP:
+        g_print ("sending group play %s\n", (char*)c->data2);
+        up_ev_play_group(c->data1, c->data2, c->data3);
+        g_strfreev(c->data1);
+        c->data1 = NULL;
+        break;
+
       case EV_SCAN:
         g_print ("sending scan\n");
         up_ev_scan();
@@ -879,6 +1685,8 @@ listener(gpointer udata)
       g_free(c->data1);
     if (c->data2) 
       g_free(c->data2);
+    if (c->data3) 
+      g_free(c->data3);
     g_free(c);
   }
 
@@ -889,6 +1697,11 @@ static gpointer
 upnp_thread (gpointer data)
 {
   GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+
+  cache_path = g_build_filename (g_get_user_cache_dir (), "vfstream",
+      CACHE_FILE, NULL);
+  cache = g_key_file_new ();
+  g_key_file_load_from_file (cache, cache_path, G_KEY_FILE_NONE, NULL);
   
   if(!init_upnp(0)) {
     g_print ("upnp init failed");
@@ -908,6 +1721,7 @@ start_upnp (void)
   g_type_init ();
 #endif
   aqueue = gst_atomic_queue_new(0);
+  evqueue = gst_atomic_queue_new(0);
   g_rec_mutex_init(&evlock);
   td = g_thread_new("upnp", upnp_thread, NULL);
   return (void*)td;
@@ -11,14 +11,41 @@
 
 #include <glib-2.0/glib.h>
 
+typedef enum
+{
+  PLAYBACK_STATE_UNKNOWN,
+  PLAYBACK_STATE_TRANSITIONING,
+  PLAYBACK_STATE_STOPPED,
+  PLAYBACK_STATE_PAUSED,
+  PLAYBACK_STATE_PLAYING
+} PlaybackState;
+
+typedef enum
+{
+  RENDERER_STATE = 0,
+  RENDERER_GONE,
+  RENDERER_ADDED
+} RendererEventType;
+
 struct Renderer {
 	char Name[50];
 	char Udn[100];
 };
 
+struct RendererEvent {
+	int Type;
+	int State;
+	char Udn[100];
+};
+
 struct Renderer* 	up_scan (int*);
+struct Renderer* 	up_list (int*);
 void 							up_stop (char*);
-void 							up_play (char*, char*);
+void 							up_play (char*, char*, const char*);
+void 							up_play_group (char**, int, char*, const char*);
+char* 						up_sink_protocol_info (const char*);
+char* 						up_action_stats (void);
+int 							up_poll_event (struct RendererEvent*);
 
 void* 						start_upnp (void);
 void  						stop_upnp (void*);
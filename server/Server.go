@@ -10,24 +10,34 @@ package main
 
 /*
 #cgo CFLAGS: -I../gst -I/usr/include/gstreamer-1.0 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -I/usr/include/libsoup-2.4 -I/usr/include/libxml2 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -I/usr/include/uuid -I/usr/include/gupnp-1.0 -I/usr/include/gssdp-1.0 -I/usr/include/libsoup-2.4 -I/usr/include/libxml2 -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -I/usr/include/uuid -I/usr/include/gupnp-av-1.0 -I/usr/include/gupnp-1.0 -I/usr/include/gssdp-1.0 -pthread -I/usr/include/glib-2.0 -I/usr/lib/x86_64-linux-gnu/glib-2.0/include -I/usr/include/gssdp-1.0 -I/usr/include/libxml2 -I/usr/lib/x86_64-linux-gnu/gstreamer-1.0/include/
-#cgo LDFLAGS: -L/home/vikram/go/src/vfstream/gst/ -L/usr/lib/x86_64-linux-gnu -ltarget -lgstbase-1.0 -lgstreamer-1.0 -lgobject-2.0 -lglib-2.0 -lgupnp-1.0 -lgupnp-av-1.0 -lgssdp-1.0 -lxml2 -lpthread -lm -lz -licui18n -licuuc -licudata -llzma
+#cgo LDFLAGS: -L/home/vikram/go/src/vfstream/gst/ -L/usr/lib/x86_64-linux-gnu -ltarget -lgstvideo-1.0 -lgstapp-1.0 -lgstsdp-1.0 -ljpeg -lgstbase-1.0 -lgstreamer-1.0 -lgobject-2.0 -lglib-2.0 -lgupnp-1.0 -lgupnp-av-1.0 -lgssdp-1.0 -lsoup-2.4 -lxml2 -lpthread -lm -lz -licui18n -licuuc -licudata -llzma
 #include <GstSource.h>
 #include <Upnp.h>
+#include <Snapshot.h>
+#include <Elements.h>
 #include <stdlib.h>
 */
 import "C"
 import (
 	"bufio"
+	"crypto/sha1"
+	"encoding/base64"
+	"encoding/binary"
 	"encoding/json"
 	"errors"
 	"fmt"
+	"io"
+	"io/ioutil"
+	"math"
 	"net"
 	"net/http"
 	"net/textproto"
 	"os"
+	"runtime"
 	"strconv"
 	"strings"
 	"sync"
+	"sync/atomic"
 	"time"
 	"unsafe"
 )
@@ -71,17 +81,39 @@ type dmrs struct {
 
 type storeS struct {
 	status   state
-	device   string
+	endpoint string
+	devices  []string
+	playing  map[string]bool
+	readers  int
+	features string
 	pipeline *C.struct_GstSource
 	then     time.Time
+
+	// admission control: what the session was expected to cost and what
+	// it is measured to cost, in cores
+	baseCost   float64
+	estimate   float64
+	cpu        float64
+	cpuUs      uint64
+	skipped    uint
+	suspended  bool
+	lastSample time.Time
+}
+
+type readerS struct {
+	reader *C.struct_GstReader
+	closed int32
 }
 
-func (f *storeS) Read(p []byte) (int, error) {
-	read := int(C.getData(f.pipeline, (*C.char)(unsafe.Pointer(&p[0])), C.int(len(p))))
+func (f *readerS) Read(p []byte) (int, error) {
+	if atomic.LoadInt32(&f.closed) != 0 {
+		return 0, io.EOF
+	}
+	read := int(C.readData(f.reader, (*C.char)(unsafe.Pointer(&p[0])), C.int(len(p))))
 	return read, nil
 }
 
-func (f *storeS) Seek(offset int64, whence int) (int64, error) {
+func (f *readerS) Seek(offset int64, whence int) (int64, error) {
 	var crazyValue int64
 	crazyValue = (1 << 31)
 
@@ -112,13 +144,17 @@ var devices map[string]state
 var hostIP string
 
 func getDMRs(w http.ResponseWriter, r *http.Request) {
-	var ds dmrs
 	var count C.int
-	var cds *C.struct_Renderer
+
+	listDMRs(C.up_scan(&count), count, w)
+}
+
+// listDMRs takes over the renderer list from the C side and frees it
+func listDMRs(cds *C.struct_Renderer, count C.int, w http.ResponseWriter) {
+	var ds dmrs
 	var cdx C.struct_Renderer
 
 	dms := make(map[string]bool)
-	cds = C.up_scan(&count)
 
 	store.lock()
 
@@ -153,6 +189,401 @@ func getDMRs(w http.ResponseWriter, r *http.Request) {
 	}
 }
 
+func getActionStats(w http.ResponseWriter, r *http.Request) {
+	cstats := C.up_action_stats()
+	jData := C.GoString(cstats)
+	C.free(unsafe.Pointer(cstats))
+
+	w.Header().Set("Content-Type", "application/json")
+	w.WriteHeader(200)
+	w.Write([]byte(jData))
+}
+
+type pipelineStats struct {
+	ShedLevel        int     `json:"shed_level"`
+	EncoderLagMs     int     `json:"encoder_lag_ms"`
+	Decimate         int     `json:"decimate"`
+	Bitrate          int     `json:"bitrate"`
+	LatencyMessages  uint    `json:"latency_messages"`
+	Errors           uint    `json:"errors"`
+	Warnings         uint    `json:"warnings"`
+	QueueOverruns    uint    `json:"queue_overruns"`
+	LeakyEnabled     uint    `json:"leaky_enabled"`
+	DecimateSteps    uint    `json:"decimate_steps"`
+	PresetDowngrades uint    `json:"preset_downgrades"`
+	EncoderRestarts  uint    `json:"encoder_restarts"`
+	StaticSkipped    uint    `json:"static_skipped"`
+	Suspended        bool    `json:"suspended"`
+	Suspends         uint    `json:"suspends"`
+	IngestDropped    uint    `json:"ingest_dropped"`
+	CpuSeconds       float64 `json:"cpu_seconds"`
+	ArenaLive        uint64  `json:"arena_live_bytes"`
+	ArenaPeak        uint64  `json:"arena_peak_bytes"`
+	ArenaReserved    uint64  `json:"arena_reserved_bytes"`
+}
+
+func getStats(w http.ResponseWriter, r *http.Request) {
+	var cs C.struct_SourceStats
+	stats := make(map[string]pipelineStats)
+
+	store.lock()
+	for id, s := range store {
+		if s == nil || s.pipeline == nil || C.getStats(s.pipeline, &cs) != 0 {
+			continue
+		}
+		stats[id] = pipelineStats{int(cs.ShedLevel), int(cs.EncoderLagMs),
+			int(cs.Decimate), int(cs.Bitrate),
+			uint(cs.LatencyMessages), uint(cs.Errors), uint(cs.Warnings),
+			uint(cs.QueueOverruns), uint(cs.LeakyEnabled),
+			uint(cs.DecimateSteps), uint(cs.PresetDowngrades),
+			uint(cs.EncoderRestarts), uint(cs.StaticSkipped),
+			cs.Suspended != 0, uint(cs.Suspends), uint(cs.IngestDropped),
+			float64(cs.CpuTimeUs) / 1e6,
+			uint64(cs.ArenaLiveBytes), uint64(cs.ArenaPeakBytes),
+			uint64(cs.ArenaReservedBytes)}
+	}
+	store.unlock()
+
+	jData, _ := json.Marshal(stats)
+	w.Header().Set("Content-Type", "application/json")
+	w.WriteHeader(200)
+	w.Write(jData)
+}
+
+type snapshotS struct {
+	sync.Mutex
+	data []byte
+	at   time.Time
+}
+
+// dashboards poll, one JPEG per source and interval is all they get
+const snapshotInterval = time.Second
+
+// cached per session and quality, so a requester always gets the quality
+// it asked for
+type snapshotKey struct {
+	id      string
+	quality int
+}
+
+var snapshots = make(map[snapshotKey]*snapshotS)
+var snapshotsMutex sync.Mutex
+
+// the camera can only be opened once, direct captures and camera sessions
+// take turns on it
+var cameraMutex sync.Mutex
+
+func dropSnapshots(id string) {
+	snapshotsMutex.Lock()
+	for key := range snapshots {
+		if key.id == id {
+			delete(snapshots, key)
+		}
+	}
+	snapshotsMutex.Unlock()
+}
+
+// takeSnapshot grabs a frame from the session with the given id, from any
+// camera session without one, or from the camera directly if none runs
+func takeSnapshot(id string, quality int) []byte {
+	var data *C.char
+	var size C.int
+	var ret C.int
+	var pipeline *C.struct_GstSource
+
+	if id == "" {
+		cameraMutex.Lock()
+		defer cameraMutex.Unlock()
+	}
+
+	store.lock()
+	for sid, s := range store {
+		if s != nil && s.pipeline != nil && (sid == id || (id == "" && s.endpoint == "camera")) {
+			pipeline = s.pipeline
+			C.holdSource(pipeline)
+			break
+		}
+	}
+	store.unlock()
+
+	if pipeline != nil {
+		ret = C.getSnapshot(pipeline, C.int(quality), &data, &size)
+		C.releaseSource(pipeline)
+	} else if id == "" {
+		ret = C.captureSnapshot(C.int(quality), &data, &size)
+	} else {
+		return nil
+	}
+
+	if ret != 0 {
+		return nil
+	}
+	defer C.free(unsafe.Pointer(data))
+
+	return C.GoBytes(unsafe.Pointer(data), size)
+}
+
+func getSnapshot(w http.ResponseWriter, r *http.Request) {
+	var id string
+	quality := 75
+
+	params := r.URL.Query()
+	if params["id"] != nil {
+		id = params["id"][0]
+	}
+	if params["quality"] != nil {
+		if q, err := strconv.Atoi(params["quality"][0]); err == nil && q > 0 && q <= 100 {
+			quality = q
+		}
+	}
+
+	key := snapshotKey{id, quality}
+	snapshotsMutex.Lock()
+	snap := snapshots[key]
+	if snap == nil {
+		snap = &snapshotS{}
+	}
+	snapshotsMutex.Unlock()
+
+	snap.Lock()
+	defer snap.Unlock()
+
+	if snap.data == nil || time.Since(snap.at) >= snapshotInterval {
+		// only sources that exist get an entry, unknown ids cannot grow
+		// the cache
+		if data := takeSnapshot(id, quality); data != nil {
+			snap.data = data
+			snap.at = time.Now()
+			snapshotsMutex.Lock()
+			if snapshots[key] == nil {
+				snapshots[key] = snap
+			}
+			snapshotsMutex.Unlock()
+		}
+	}
+
+	if snap.data == nil {
+		w.WriteHeader(503)
+		return
+	}
+
+	w.Header().Set("Content-Type", "image/jpeg")
+	w.Header().Set("Cache-Control", "max-age=1")
+	w.WriteHeader(200)
+	w.Write(snap.data)
+}
+
+// Serves the session description of a session's multicast output, what
+// a receiver on the LAN opens to join the group.
+func getSdp(w http.ResponseWriter, r *http.Request) {
+	var sdp *C.char
+	var ret C.int = -1
+	var id string
+
+	params := r.URL.Query()
+	if params["id"] != nil {
+		id = params["id"][0]
+	}
+
+	store.lock()
+	s := store[id]
+	if s != nil && s.pipeline != nil {
+		C.holdSource(s.pipeline)
+		pipeline := s.pipeline
+		store.unlock()
+		ret = C.getSdp(pipeline, &sdp)
+		C.releaseSource(pipeline)
+	} else {
+		store.unlock()
+	}
+
+	if ret != 0 {
+		w.WriteHeader(404)
+		return
+	}
+	defer C.free(unsafe.Pointer(sdp))
+
+	w.Header().Set("Content-Type", "application/sdp")
+	w.WriteHeader(200)
+	io.WriteString(w, C.GoString(sdp))
+}
+
+const wsGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC11B65"
+
+// Writes one unmasked WebSocket frame.
+func wsWrite(conn net.Conn, opcode byte, payload []byte) error {
+	hdr := []byte{0x80 | opcode, 0}
+
+	switch n := len(payload); {
+	case n < 126:
+		hdr[1] = byte(n)
+	case n < 65536:
+		hdr[1] = 126
+		hdr = append(hdr, 0, 0)
+		binary.BigEndian.PutUint16(hdr[2:], uint16(n))
+	default:
+		hdr[1] = 127
+		hdr = append(hdr, 0, 0, 0, 0, 0, 0, 0, 0)
+		binary.BigEndian.PutUint64(hdr[2:], uint64(n))
+	}
+
+	bufs := net.Buffers{hdr, payload}
+	_, err := bufs.WriteTo(conn)
+	return err
+}
+
+// Reads what the browser sends until it closes, answering pings. Data
+// frames from the viewer are not expected and dropped.
+func wsReadLoop(rd *bufio.Reader, conn net.Conn, wlock *sync.Mutex) {
+	var hdr [8]byte
+	var mask [4]byte
+
+	for {
+		if _, err := io.ReadFull(rd, hdr[:2]); err != nil {
+			return
+		}
+		opcode := hdr[0] & 0x0f
+		n := uint64(hdr[1] & 0x7f)
+		if n == 126 {
+			if _, err := io.ReadFull(rd, hdr[:2]); err != nil {
+				return
+			}
+			n = uint64(binary.BigEndian.Uint16(hdr[:2]))
+		} else if n == 127 {
+			if _, err := io.ReadFull(rd, hdr[:8]); err != nil {
+				return
+			}
+			n = binary.BigEndian.Uint64(hdr[:8])
+		}
+		if hdr[1]&0x80 != 0 {
+			if _, err := io.ReadFull(rd, mask[:]); err != nil {
+				return
+			}
+		}
+
+		if opcode < 8 {
+			if _, err := io.CopyN(ioutil.Discard, rd, int64(n)); err != nil {
+				return
+			}
+			continue
+		}
+
+		// control frames carry at most 125 bytes
+		if n > 125 {
+			return
+		}
+		payload := make([]byte, n)
+		if _, err := io.ReadFull(rd, payload); err != nil {
+			return
+		}
+		for i := range payload {
+			payload[i] ^= mask[i%4]
+		}
+
+		wlock.Lock()
+		if opcode == 8 {
+			wsWrite(conn, 8, payload)
+			wlock.Unlock()
+			return
+		} else if opcode == 9 {
+			wsWrite(conn, 10, payload)
+		}
+		wlock.Unlock()
+	}
+}
+
+// Pushes a session to a browser over WebSocket, one binary message per
+// fragment the moment the muxer produces it, the first being the init
+// segment, for playback through Media Source Extensions. A viewer that
+// cannot keep up loses fragments up to the next keyframe.
+func getLive(w http.ResponseWriter, r *http.Request) {
+	var id string
+
+	params := r.URL.Query()
+	if params["id"] != nil {
+		id = params["id"][0]
+	}
+
+	key := r.Header.Get("Sec-WebSocket-Key")
+	if !strings.EqualFold(r.Header.Get("Upgrade"), "websocket") || key == "" {
+		w.WriteHeader(400)
+		return
+	}
+
+	hj, ok := w.(http.Hijacker)
+	if !ok {
+		w.WriteHeader(500)
+		return
+	}
+
+	rd := attach(id, true)
+	if rd == nil {
+		w.WriteHeader(404)
+		return
+	}
+	defer detach(id, rd)
+
+	conn, bufrw, err := hj.Hijack()
+	if err != nil {
+		return
+	}
+	defer conn.Close()
+
+	accept := sha1.Sum([]byte(key + wsGUID))
+	bufrw.WriteString("HTTP/1.1 101 Switching Protocols\r\n" +
+		"Upgrade: websocket\r\nConnection: Upgrade\r\n" +
+		"Sec-WebSocket-Accept: " + base64.StdEncoding.EncodeToString(accept[:]) + "\r\n\r\n")
+	if bufrw.Flush() != nil {
+		return
+	}
+
+	var wlock sync.Mutex
+	go func() {
+		wsReadLoop(bufrw.Reader, conn, &wlock)
+		atomic.StoreInt32(&rd.closed, 1)
+	}()
+
+	buf := make([]byte, 256*1024)
+	for atomic.LoadInt32(&rd.closed) == 0 {
+		// the session was stopped, tell the viewer it is going away
+		// rather than leaving it on a silent socket
+		if getStatus(id) == DOWN {
+			wlock.Lock()
+			conn.SetWriteDeadline(time.Now().Add(5 * time.Second))
+			wsWrite(conn, 8, []byte{0x03, 0xE9})
+			wlock.Unlock()
+			break
+		}
+
+		n := int(C.readFragment(rd.reader, (*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf)), 500))
+		if n < 0 {
+			buf = make([]byte, -n)
+			continue
+		} else if n == 0 {
+			continue
+		}
+
+		wlock.Lock()
+		conn.SetWriteDeadline(time.Now().Add(5 * time.Second))
+		err := wsWrite(conn, 2, buf[:n])
+		wlock.Unlock()
+		if err != nil {
+			break
+		}
+	}
+}
+
+func shmFd(id string) int {
+	store.lock()
+	defer store.unlock()
+
+	if store[id] == nil {
+		return -1
+	}
+
+	return int(C.getShmFd(store[id].pipeline))
+}
+
 func getStatus(id string) state {
 	store.lock()
 	defer store.unlock()
@@ -164,34 +595,233 @@ func getStatus(id string) state {
 	return store[id].status
 }
 
-func setInit(device string, endpoint string) string {
+func attach(id string, live bool) *readerS {
+	store.lock()
+	defer store.unlock()
+
+	if store[id] == nil {
+		return nil
+	}
+
+	store[id].readers++
+	if live {
+		return &readerS{C.attachLiveReader(store[id].pipeline), 0}
+	}
+	return &readerS{C.attachReader(store[id].pipeline), 0}
+}
+
+func detach(id string, rd *readerS) {
+	last := false
+
+	C.detachReader(rd.reader)
+
+	store.lock()
+	if store[id] != nil {
+		store[id].readers--
+		last = store[id].readers == 0
+	}
+	store.unlock()
+
+	if last {
+		setInactive(id)
+	}
+}
+
+var scaleModes = map[string]C.int{
+	"fast":     C.SCALE_FAST,
+	"balanced": C.SCALE_BALANCED,
+	"quality":  C.SCALE_QUALITY,
+}
+
+// Admission control. A session's cost is estimated from its pixel rate,
+// the encoder preset and whether frames need converting or decoding, and
+// scaled by how far off the estimates turned out for sessions already
+// running. New sessions only get what is left of the CPU budget, so the
+// running ones keep their quality.
+const (
+	refPixelRate    = 1280 * 720 * 30
+	refCost         = 0.5  // cores for 720p30 on the default preset
+	tileCost        = 0.05 // cores to capture and scale one mosaic camera
+	cpuBudgetShare  = 0.85
+	retryAfter      = 15
+	loadSampleEvery = 2 * time.Second
+)
+
+// profiles to fall back to, largest first; 0 leaves the choice to the
+// renderers
+var admitMaxPixels = []int{0, 640 * 480, 352 * 288, 320 * 240}
+
+var cpuBudget = float64(runtime.NumCPU()) * cpuBudgetShare
+var costRatio = 1.0
+
+func estimateCost(e *C.struct_SessionEstimate) float64 {
+	cost := refCost * float64(e.Width*e.Height*e.Fps) / refPixelRate
+	if e.Preset <= 2 {
+		cost *= 0.4
+	}
+	if e.Passthrough == 0 {
+		cost *= 1.2
+	}
+	if e.Decode != 0 {
+		cost *= 1.5
+	}
+	return cost
+}
+
+// currentLoad is called with the store locked
+func currentLoad() float64 {
+	load := 0.0
+	for _, s := range store {
+		if s == nil || s.pipeline == nil {
+			continue
+		}
+		// a suspended session takes its share back as soon as a reader
+		// attaches, its measured cost says nothing until then
+		if s.cpu > 0 && !s.suspended {
+			load += s.cpu
+		} else {
+			load += s.estimate
+		}
+	}
+	return load
+}
+
+type sessionCost struct {
+	maxPixels int
+	base      float64
+	profile   string
+}
+
+// estimates prices a session at each of the fallback profiles. The first
+// estimate probes the camera, so it must not run with the store locked.
+func estimates(udns []string, endpoint string, cfg *C.struct_SourceConfig) []sessionCost {
+	var e C.struct_SessionEstimate
+	var costs []sessionCost
+
+	cdevs := C.CString(strings.Join(udns, ","))
+	ctype := C.CString(endpoint)
+	defer C.free(unsafe.Pointer(cdevs))
+	defer C.free(unsafe.Pointer(ctype))
+
+	for _, max := range admitMaxPixels {
+		if C.estimateSession(cdevs, ctype, C.int(max), &e) != 0 {
+			continue
+		}
+		base := estimateCost(&e)
+		if endpoint == "mosaic" && cfg.Sources != nil {
+			// every camera is captured and scaled to its tile on top
+			base += tileCost * float64(strings.Count(C.GoString(cfg.Sources), ",")+1)
+		}
+		costs = append(costs, sessionCost{max, base, C.GoString(&e.Profile[0])})
+	}
+	return costs
+}
+
+// admit picks the largest profile whose cost still fits, called with the
+// store locked
+func admit(costs []sessionCost, cfg *C.struct_SourceConfig) (float64, string, bool) {
+	load := currentLoad()
+	for _, c := range costs {
+		if load+c.base*costRatio <= cpuBudget {
+			cfg.MaxPixels = C.int(c.maxPixels)
+			return c.base, c.profile, true
+		}
+	}
+
+	fmt.Printf("rejecting session, load %.2f of %.2f cores\n", load, cpuBudget)
+	return 0, "", false
+}
+
+// watchLoad measures what every session really costs and learns how far
+// the estimates are off. Sessions skipping static frames cost less than
+// they will once the scene moves, they do not teach anything.
+func watchLoad() {
+	var cs C.struct_SourceStats
+
+	for {
+		time.Sleep(loadSampleEvery)
+
+		store.lock()
+		for _, s := range store {
+			if s == nil || s.pipeline == nil || C.getStats(s.pipeline, &cs) != 0 {
+				continue
+			}
+
+			now := time.Now()
+			suspended := cs.Suspended != 0
+			if !s.lastSample.IsZero() {
+				cores := float64(uint64(cs.CpuTimeUs)-s.cpuUs) / 1e6 / now.Sub(s.lastSample).Seconds()
+				if s.suspended && !suspended {
+					// resumed, measure up from the expected cost again
+					s.cpu = s.estimate
+				}
+				s.cpu = 0.7*s.cpu + 0.3*cores
+				// skipped or suspended frames say nothing about the estimate
+				if uint(cs.StaticSkipped) == s.skipped && cs.Suspended == 0 && s.baseCost > 0 {
+					costRatio = 0.9*costRatio + 0.1*(cores/s.baseCost)
+					costRatio = math.Max(0.25, math.Min(4, costRatio))
+				}
+			}
+			s.cpuUs = uint64(cs.CpuTimeUs)
+			s.skipped = uint(cs.StaticSkipped)
+			s.suspended = suspended
+			s.lastSample = now
+		}
+		store.unlock()
+	}
+}
+
+func setInit(udns []string, endpoint string, cfg *C.struct_SourceConfig) (string, string, bool) {
 	var ret C.int
 
+	if endpoint == "camera" {
+		cameraMutex.Lock()
+		defer cameraMutex.Unlock()
+	}
+
+	costs := estimates(udns, endpoint, cfg)
+
 	store.lock()
 	defer store.unlock()
 
+	base, profile, ok := admit(costs, cfg)
+	if !ok {
+		return "", "", false
+	}
+
 	vid++
 	id := strconv.Itoa(vid)
 
 	if store[id] != nil {
-		return ""
+		return "", "", true
 	}
 
-	devices[device] = INIT
+	for _, device := range udns {
+		devices[device] = INIT
+	}
 	store[id] = &storeS{
-		INIT,
-		device,
-		nil,
-		time.Now(),
+		status:   INIT,
+		endpoint: endpoint,
+		devices:  udns,
+		playing:  make(map[string]bool),
+		then:     time.Now(),
+		baseCost: base,
+		estimate: base * costRatio,
 	}
 
 	http.HandleFunc("/"+endpoint+id+".mp4", func(w http.ResponseWriter, r *http.Request) {
+		store.lock()
+		var features string
+		if store[id] != nil {
+			features = store[id].features
+		}
+		store.unlock()
+
 		if r.Method == "HEAD" {
 			w.Header().Set("Pragma", "no-cache")
 			w.Header().Set("Cache-control", "no-cache")
 			w.Header().Set("Accept-Ranges", "none")
-			w.Header().Add("contentFeatures.dlna.org",
-				"DLNA.ORG_PN=AVC_MP4_BL_CIF15_AAC_520;DLNA.ORG_OP=00;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=05700000000000000000000000000000")
+			w.Header().Add("contentFeatures.dlna.org", features)
 			w.Header().Add("transferMode.dlna.org", "Streaming")
 			w.Header().Set("Content-Type", "video/mp4")
 			//TESTVV
@@ -200,14 +830,22 @@ func setInit(device string, endpoint string) string {
 			//w.Header().Set("User-Agent", "HttpMediaServer/1.0")
 			w.WriteHeader(200)
 		} else if r.Method == "GET" {
+			rd := attach(id, false)
+			if rd == nil {
+				w.WriteHeader(404)
+				return
+			}
+
 			go func(c <-chan bool) {
 				<-c
-				setInactive(id)
+				atomic.StoreInt32(&rd.closed, 1)
 			}(w.(http.CloseNotifier).CloseNotify())
 
 			go func() {
-				dur := time.Since(store[id].then)
-				if dur > 10*time.Second {
+				store.lock()
+				s := store[id]
+				store.unlock()
+				if s != nil && time.Since(s.then) > 10*time.Second {
 					fmt.Println("no health monitoring, closing ", id)
 					setInactive(id)
 				}
@@ -216,30 +854,31 @@ func setInit(device string, endpoint string) string {
 			w.Header().Set("Pragma", "no-cache")
 			w.Header().Set("Cache-control", "no-cache")
 			w.Header().Set("Accept-Ranges", "none")
-			w.Header().Add("contentFeatures.dlna.org",
-				"DLNA.ORG_PN=AVC_MP4_BL_CIF15_AAC_520;DLNA.ORG_OP=00;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=05700000000000000000000000000000")
+			w.Header().Add("contentFeatures.dlna.org", features)
 			w.Header().Add("transferMode.dlna.org", "Streaming")
 			w.Header().Set("Content-Type", "video/mp4")
 			//TESTVV
 			fmt.Println("Got GETTT")
 			//w.Header().Add("EXT", "")
 			//w.Header().Set("User-Agent", "HttpMediaServer/1.0")
-			http.ServeContent(w, r, id+"_"+endpoint+"_"+device, time.Now(), store[id])
+			http.ServeContent(w, r, id+"_"+endpoint, time.Now(), rd)
+			detach(id, rd)
 		}
 	})
 
-	store[id].pipeline = C.startPipeline(C.int(vid), C.CString(device), C.CString(endpoint),
-		C.CString("http://"+hostIP+":7070/"+endpoint+id+".mp4"), &ret)
+	store[id].pipeline = C.startPipeline(C.int(vid), C.CString(strings.Join(udns, ",")), C.CString(endpoint),
+		C.CString("http://"+hostIP+":7070/"+endpoint+id+".mp4"), cfg, &ret)
 	if ret == -1 {
 		fmt.Println("ERROR: failed to setup the pipeline")
-		C.destroyPipeline(store[id].pipeline)
-		return ""
+		endSession(id)
+		return "", "", true
 	}
+	store[id].features = C.GoString(C.getContentFeatures(store[id].pipeline))
 
-	return id
+	return id, profile, true
 }
 
-func setActive(id string) bool {
+func setActive(id string, device string) bool {
 	store.lock()
 	defer store.unlock()
 
@@ -247,7 +886,8 @@ func setActive(id string) bool {
 		return false
 	}
 
-	devices[store[id].device] = RUN
+	devices[device] = RUN
+	store[id].playing[device] = true
 	store[id].status = RUN
 
 	return true
@@ -261,13 +901,144 @@ func setInactive(id string) bool {
 		return false
 	}
 
+	endSession(id)
+
+	return true
+}
+
+// endSession tears a session down and gives its renderers back, the
+// store lock must be held
+func endSession(id string) {
 	C.destroyPipeline(store[id].pipeline)
-	devices[store[id].device] = READY
+	for _, device := range store[id].devices {
+		devices[device] = READY
+	}
 	store[id] = nil
+	dropSnapshots(id)
+}
+
+func isPlaying(id string, device string) bool {
+	store.lock()
+	defer store.unlock()
+
+	return store[id] != nil && store[id].playing[device]
+}
+
+func addMember(id string, device string) bool {
+	store.lock()
+	defer store.unlock()
+
+	if store[id] == nil || devices[device] == DOWN || devices[device] > READY {
+		return false
+	}
+
+	cdev := C.CString(device)
+	defer C.free(unsafe.Pointer(cdev))
+	if C.addRenderer(store[id].pipeline, cdev) != 0 {
+		return false
+	}
+
+	devices[device] = INIT
+	store[id].devices = append(store[id].devices, device)
 
 	return true
 }
 
+// Drops one renderer from a session, the session itself goes away with
+// its last renderer.
+func dropMember(id string, device string) bool {
+	store.lock()
+
+	s := store[id]
+	if s == nil {
+		store.unlock()
+		return false
+	}
+
+	member := -1
+	for i, d := range s.devices {
+		if d == device {
+			member = i
+			break
+		}
+	}
+	if member < 0 {
+		store.unlock()
+		return false
+	}
+
+	if len(s.devices) > 1 {
+		s.devices = append(s.devices[:member], s.devices[member+1:]...)
+		delete(s.playing, device)
+		devices[device] = READY
+		cdev := C.CString(device)
+		C.removeRenderer(s.pipeline, cdev)
+		C.free(unsafe.Pointer(cdev))
+		store.unlock()
+		return true
+	}
+
+	store.unlock()
+	return setInactive(id)
+}
+
+func sessionsOf(device string) []string {
+	var ids []string
+
+	store.lock()
+	defer store.unlock()
+
+	for id, s := range store {
+		if s == nil {
+			continue
+		}
+		for _, d := range s.devices {
+			if d == device {
+				ids = append(ids, id)
+				break
+			}
+		}
+	}
+
+	return ids
+}
+
+func watchRenderers() {
+	var ev C.struct_RendererEvent
+
+	for {
+		for C.up_poll_event(&ev) != 0 {
+			udn := C.GoString(&ev.Udn[0])
+
+			for _, id := range sessionsOf(udn) {
+				if ev.Type == C.RENDERER_GONE {
+					fmt.Println("renderer gone, leaving ", id)
+					dropMember(id, udn)
+				} else if ev.State == C.PLAYBACK_STATE_PLAYING {
+					setActive(id, udn)
+				} else if ev.State == C.PLAYBACK_STATE_STOPPED && isPlaying(id, udn) {
+					fmt.Println("renderer stopped, leaving ", id)
+					dropMember(id, udn)
+				}
+			}
+
+			if ev.Type == C.RENDERER_GONE {
+				store.lock()
+				devices[udn] = DOWN
+				store.unlock()
+			} else if ev.Type == C.RENDERER_ADDED {
+				store.lock()
+				if devices[udn] == DOWN {
+					devices[udn] = READY
+				}
+				store.unlock()
+			}
+		}
+
+		time.Sleep(200 * time.Millisecond)
+	}
+}
+
 func isDeviceAvailable(device string) bool {
 	store.lock()
 	defer store.unlock()
@@ -278,10 +1049,13 @@ func isDeviceAvailable(device string) bool {
 func stream(w http.ResponseWriter, r *http.Request) {
 	var code = 400
 	var device, idv, action, endpoint string
+	var udns []string
+	var cfg C.struct_SourceConfig
 
 	params := r.URL.Query()
 	if params["device"] != nil {
 		device = params["device"][0]
+		udns = params["device"]
 	}
 	if params["endpoint"] != nil {
 		endpoint = params["endpoint"][0]
@@ -293,6 +1067,83 @@ func stream(w http.ResponseWriter, r *http.Request) {
 		action = params["action"][0]
 	}
 
+	if params["gop"] != nil {
+		if gop, err := strconv.Atoi(params["gop"][0]); err == nil {
+			cfg.KeyframeInterval = C.int(gop)
+		}
+	}
+
+	if params["latency"] != nil {
+		if ms, err := strconv.Atoi(params["latency"][0]); err == nil {
+			cfg.RtpLatency = C.int(ms)
+		}
+	}
+
+	// static=<avg luma difference> skips unchanged frames, static=off encodes all
+	if params["static"] != nil {
+		if params["static"][0] == "off" {
+			cfg.StaticThreshold = -1
+		} else if th, err := strconv.Atoi(params["static"][0]); err == nil && th > 0 {
+			cfg.StaticThreshold = C.int(th)
+		}
+	}
+	if params["keepalive"] != nil {
+		if ms, err := strconv.Atoi(params["keepalive"][0]); err == nil {
+			cfg.StaticKeepAlive = C.int(ms)
+		}
+	}
+
+	cfg.Cpu = -1
+	if params["cpu"] != nil {
+		if cpu, err := strconv.Atoi(params["cpu"][0]); err == nil && cpu >= 0 {
+			cfg.Cpu = C.int(cpu)
+		}
+	}
+
+	// mcast=<group>[:<port>] also sends the stream as RTP to a multicast group
+	if params["mcast"] != nil {
+		group := params["mcast"][0]
+		if i := strings.LastIndex(group, ":"); i > 0 {
+			if port, err := strconv.Atoi(group[i+1:]); err == nil {
+				cfg.McastPort = C.int(port)
+			}
+			group = group[:i]
+		}
+		cfg.McastGroup = C.CString(group)
+		defer C.free(unsafe.Pointer(cfg.McastGroup))
+		// sent from the interface the server streams on
+		cfg.McastIface = C.CString(hostIP)
+		defer C.free(unsafe.Pointer(cfg.McastIface))
+	}
+	if params["ttl"] != nil {
+		if ttl, err := strconv.Atoi(params["ttl"][0]); err == nil && ttl > 0 && ttl < 256 {
+			cfg.McastTtl = C.int(ttl)
+		}
+	}
+	if params["pace"] != nil {
+		if kbps, err := strconv.Atoi(params["pace"][0]); err == nil {
+			cfg.McastRate = C.int(kbps)
+		}
+	}
+
+	// a mosaic session tiles the cameras given as source=/dev/videoN...
+	if params["source"] != nil {
+		cfg.Sources = C.CString(strings.Join(params["source"], ","))
+		defer C.free(unsafe.Pointer(cfg.Sources))
+	}
+
+	// shm=1 also publishes the fragments to a shared memory ring
+	if params["shm"] != nil && params["shm"][0] == "1" {
+		cfg.Shm = 1
+	}
+
+	cfg.ScaleMode = C.SCALE_BALANCED
+	if params["scale"] != nil {
+		if mode, ok := scaleModes[params["scale"][0]]; ok {
+			cfg.ScaleMode = mode
+		}
+	}
+
 	if r.Method != "POST" {
 		code = 501
 		goto end
@@ -302,20 +1153,70 @@ func stream(w http.ResponseWriter, r *http.Request) {
 		if idv != "" {
 			setInactive(idv)
 		}
+	} else if action == "join" {
+		if idv == "" || device == "" {
+			goto end
+		}
+
+		if addMember(idv, device) {
+			code = 200
+		} else {
+			code = 503
+		}
+	} else if action == "leave" {
+		if idv == "" || device == "" {
+			goto end
+		}
+
+		if dropMember(idv, device) {
+			code = 200
+		}
 	} else if action == "play" {
-		if device == "" || (endpoint != "camera") {
+		if device == "" || (endpoint != "camera" && endpoint != "streaming" && endpoint != "mosaic") {
+			goto end
+		}
+		if endpoint == "mosaic" && cfg.Sources == nil {
 			goto end
 		}
 
-		if !isDeviceAvailable(device) {
+		// a streaming session may describe its feed with SDP in the body
+		if endpoint == "streaming" {
+			if sdp, err := ioutil.ReadAll(io.LimitReader(r.Body, 64*1024)); err == nil && len(sdp) > 0 {
+				cfg.Sdp = C.CString(string(sdp))
+				defer C.free(unsafe.Pointer(cfg.Sdp))
+			}
+		}
+
+		available := true
+		for _, d := range udns {
+			available = available && isDeviceAvailable(d)
+		}
+
+		if !available {
 			code = 503
 		} else {
-			if id := setInit(device, endpoint); id == "" {
-				setInactive(id)
+			if id, profile, admitted := setInit(udns, endpoint, &cfg); !admitted {
+				w.Header().Set("Retry-After", strconv.Itoa(retryAfter))
+				code = 503
+			} else if id == "" {
 				code = 503
 			} else {
 				w.Header().Add("Identifier", id)
+				w.Header().Add("Profile", profile)
 				w.Header().Add("Healthport", "3221")
+				if endpoint == "streaming" {
+					// sessions receive RTP on the port matching their id
+					w.Header().Add("Rtpport", id)
+				}
+				if cfg.McastGroup != nil {
+					w.Header().Add("Sdp", "/sdp?id="+id)
+				}
+				if cfg.Shm != 0 {
+					// local consumers map the ring through our fd
+					if fd := shmFd(id); fd >= 0 {
+						w.Header().Add("Shm", fmt.Sprintf("/proc/%d/fd/%d", os.Getpid(), fd))
+					}
+				}
 				code = 200
 			}
 		}
@@ -399,6 +1300,11 @@ func main() {
 	fmt.Println("Stream IP: " + hostIP)
 	http.HandleFunc("/dmrs", getDMRs)
 	http.HandleFunc("/stream", stream)
+	http.HandleFunc("/actions", getActionStats)
+	http.HandleFunc("/stats", getStats)
+	http.HandleFunc("/snapshot", getSnapshot)
+	http.HandleFunc("/sdp", getSdp)
+	http.HandleFunc("/live", getLive)
 
 	if ln, err := net.Listen("tcp", ":3221"); err != nil {
 		fmt.Println(err)
@@ -407,8 +1313,17 @@ func main() {
 		go monitorStreams(ln)
 	}
 
+	// plugins and the encoder are loaded before anything is served, the
+	// first play then starts as quickly as any other
+	C.initMedia()
+
+	// no scan up front: renderers known from earlier runs come out of the
+	// cache, new ones are announced through watchRenderers
 	C.start_upnp()
-	getDMRs(nil, nil)
+	var count C.int
+	listDMRs(C.up_list(&count), count, nil)
+	go watchRenderers()
+	go watchLoad()
 
 	if err := http.ListenAndServe(":7070", nil); err != nil {
 		fmt.Println(err)